@@ -0,0 +1,46 @@
+return describe("parse budget", function()
+	local codes = ("x = 1\n"):rep(1000)
+	it("should stop the compilation once spent", function()
+		local luaCodes, err = yue.to_lua(codes, {
+			parse_budget = 5000
+		})
+		assert.is_nil(luaCodes)
+		return assert.is_truthy(err:find("parse budget exceeded", 1, true))
+	end)
+	it("should stop at the same position each time", function()
+		local _, err = yue.to_lua(codes, {
+			parse_budget = 5000
+		})
+		for i = 1, 3 do
+			local again
+			_, again = yue.to_lua(codes, {
+				parse_budget = 5000
+			})
+			assert.same(err, again)
+		end
+	end)
+	it("should stop later with a larger budget", function()
+		local _, err = yue.to_lua(codes, {
+			parse_budget = 5000
+		})
+		local later
+		_, later = yue.to_lua(codes, {
+			parse_budget = 100000
+		})
+		return assert.is_true(tonumber(err:match("^%d+")) < tonumber(later:match("^%d+")))
+	end)
+	it("should compile within the budget", function()
+		local luaCodes, err = yue.to_lua(codes, {
+			parse_budget = 1000000
+		})
+		assert.is_nil(err)
+		return assert.same(luaCodes, yue.to_lua(codes))
+	end)
+	return it("should compile without a limit when zero", function()
+		local luaCodes, err = yue.to_lua(codes, {
+			parse_budget = 0
+		})
+		assert.is_nil(err)
+		return assert.same(luaCodes, yue.to_lua(codes))
+	end)
+end)
@@ -9,6 +9,8 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 #include "yuescript/yue_compiler.h"
 #include "yuescript/yue_parser.h"
 
+#include <algorithm>
+#include <cctype>
 #include <chrono>
 #include <cstdlib>
 #include <fstream>
@@ -144,6 +146,81 @@ fs::path getTargetFileDirty(const fs::path& file, const fs::path& workPath, cons
 	return fs::path();
 }
 
+static std::string jsonString(std::string_view str) {
+	std::ostringstream buf;
+	buf << '"';
+	for (char ch : str) {
+		switch (ch) {
+			case '"':
+				buf << "\\\""sv;
+				break;
+			case '\\':
+				buf << "\\\\"sv;
+				break;
+			case '\n':
+				buf << "\\n"sv;
+				break;
+			case '\t':
+				buf << "\\t"sv;
+				break;
+			default:
+				if (static_cast<unsigned char>(ch) < 0x20) {
+					buf << "\\u"sv << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(ch) << std::dec;
+				} else {
+					buf << ch;
+				}
+				break;
+		}
+	}
+	buf << '"';
+	return buf.str();
+}
+
+static std::string dumpRuleProfiles(const std::string& file, yue::CompileInfo& result, bool json) {
+	auto& profiles = *result.ruleProfiles;
+	std::sort(profiles.begin(), profiles.end(), [](const auto& a, const auto& b) {
+		return a.exclusiveTime > b.exclusiveTime;
+	});
+	std::ostringstream buf;
+	if (json) {
+		buf << "{\"file\":"sv << jsonString(file) << ",\"parseTime\":"sv << result.parseTime << ",\"rules\":["sv;
+		for (auto it = profiles.begin(); it != profiles.end(); ++it) {
+			if (it != profiles.begin()) buf << ',';
+			buf << "{\"name\":"sv << jsonString(it->name)
+				<< ",\"calls\":"sv << it->calls
+				<< ",\"successes\":"sv << it->successes
+				<< ",\"failures\":"sv << it->failures
+				<< ",\"consumed\":"sv << it->consumed
+				<< ",\"backtracked\":"sv << it->backtracked
+				<< ",\"memoHits\":"sv << it->memoHits
+				<< ",\"memoMisses\":"sv << it->memoMisses
+				<< ",\"inclusiveTime\":"sv << it->inclusiveTime
+				<< ",\"exclusiveTime\":"sv << it->exclusiveTime << '}';
+		}
+		buf << "]}\n"sv;
+		return buf.str();
+	}
+	buf << file << " \n"sv;
+	buf << "Parse time:     "sv << std::setprecision(5) << result.parseTime * 1000 << " ms\n"sv;
+	buf << "Optimized:      "sv << yue::YueParser::shared().optimizedExprCount() << " grammar expressions removed\n"sv;
+	buf << std::left << std::setw(32) << "Rule"sv << std::right
+		<< std::setw(10) << "Calls"sv << std::setw(10) << "Success"sv << std::setw(10) << "Failure"sv
+		<< std::setw(12) << "Consumed"sv << std::setw(12) << "Backtracked"sv
+		<< std::setw(10) << "Memo hit"sv << std::setw(10) << "Memo miss"sv
+		<< std::setw(12) << "Incl (ms)"sv << std::setw(12) << "Excl (ms)"sv << '\n';
+	for (const auto& profile : profiles) {
+		buf << std::left << std::setw(32) << (profile.name.empty() ? "(unnamed)"s : profile.name) << std::right
+			<< std::setw(10) << profile.calls << std::setw(10) << profile.successes << std::setw(10) << profile.failures
+			<< std::setw(12) << profile.consumed << std::setw(12) << profile.backtracked
+			<< std::setw(10) << profile.memoHits << std::setw(10) << profile.memoMisses
+			<< std::fixed << std::setprecision(3)
+			<< std::setw(12) << profile.inclusiveTime * 1000 << std::setw(12) << profile.exclusiveTime * 1000
+			<< std::defaultfloat << '\n';
+	}
+	buf << '\n';
+	return buf.str();
+}
+
 #ifndef YUE_NO_WATCHER
 
 #ifndef YUE_COMPILER_ONLY
@@ -292,6 +369,11 @@ int main(int narg, const char** args) {
 		"   -s       Use spaces in generated codes instead of tabs\n"
 		"   -p       Write output to standard out\n"
 		"   -b       Dump compile time (doesn't write output)\n"
+		"   -R       Dump parse counters of the grammar rules (doesn't write output)\n"
+		"   -J       Dump parse counters of the grammar rules in JSON lines\n"
+		"            (doesn't write output)\n"
+		"   -P num   Parse large files with num threads\n"
+		"   -M name  Memoize the grammar rule of an AST name when parsing\n"
 		"   -g       Dump global variables used in NAME LINE COLUMN\n"
 		"   -l       Write line numbers from source codes\n"
 		"   -j       Disable implicit return at end of file\n"
@@ -459,6 +541,8 @@ int main(int narg, const char** args) {
 	config.useSpaceOverTab = false;
 	bool writeToFile = true;
 	bool dumpCompileTime = false;
+	bool dumpRuleProfile = false;
+	bool dumpRuleProfileJson = false;
 	bool lintGlobal = false;
 	bool watchFiles = false;
 	std::string targetPath;
@@ -617,6 +701,29 @@ int main(int narg, const char** args) {
 			}
 		} else if (arg == "-b"sv) {
 			dumpCompileTime = true;
+		} else if (arg == "-R"sv) {
+			dumpRuleProfile = true;
+		} else if (arg == "-J"sv) {
+			dumpRuleProfileJson = true;
+		} else if (arg == "-P"sv) {
+			++i;
+			if (i < narg && std::isdigit(static_cast<unsigned char>(args[i][0]))) {
+				config.parseThreads = std::atoi(args[i]);
+			} else {
+				std::cout << help;
+				return 1;
+			}
+		} else if (arg == "-M"sv) {
+			++i;
+			if (i < narg) {
+				if (!yue::YueParser::shared().setMemo(args[i])) {
+					std::cout << "Error: can not memoize rule "sv << args[i] << '\n';
+					return 1;
+				}
+			} else {
+				std::cout << help;
+				return 1;
+			}
 		} else if (arg == "-h"sv) {
 			std::cout << help;
 			return 0;
@@ -770,6 +877,19 @@ int main(int narg, const char** args) {
 						return std::tuple{1, file.first, buf.str()};
 					}
 				}
+				if (dumpRuleProfile || dumpRuleProfileJson) {
+					conf.profiling = true;
+					conf.profilingRules = true;
+					auto result = yue::YueCompiler{YUE_ARGS}.compile(s, conf);
+					if (!result.error) {
+						return std::tuple{0, file.first, dumpRuleProfiles(file.first, result, dumpRuleProfileJson)};
+					} else {
+						std::ostringstream buf;
+						buf << "Failed to compile: "sv << file.first << '\n';
+						buf << result.error.value().displayMessage << '\n';
+						return std::tuple{1, file.first, buf.str()};
+					}
+				}
 				conf.lintGlobalVariable = lintGlobal;
 				auto result = yue::YueCompiler{YUE_ARGS}.compile(s, conf);
 				if (!result.error) {
@@ -0,0 +1,184 @@
+/* Copyright (c) 2017-2025 Li Jin <dragon-fly@qq.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+// Checks the parse results which are not made by a plain full parse of the
+// codes.
+//
+// Built by `make check`, it edits the given files and the files under the
+// given directories, and fails when a reparse of an edit gives another AST
+// than a full parse of the edited codes. It also fails when a parse reusing
+// the token results gives another AST than a parse without them, or when
+// the AST image of a parse result, loaded from the mapped image file, gives
+// another AST than the parse.
+
+#include "yuescript/yue_parser.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+using namespace std::string_view_literals;
+using namespace std::string_literals;
+namespace fs = std::filesystem;
+
+// edits made to each file, one after another
+static const int EDITS_PER_FILE = 40;
+
+// texts inserted by the edits
+static const std::string_view editTexts[] = {
+	""sv, "x"sv, "_tmp"sv, " "sv, "\n"sv, "\n\n"sv, "("sv, ")"sv, "="sv, "\""sv,
+	"--"sv, "\n  "sv, "a = 1\n"sv, "|>"sv, "\\"sv, "[["sv, "\t"sv, "."sv, ":"sv, "->"sv,
+	"print 'ok'\n"sv, "\nf = ->\n\tnil\n"sv};
+
+// dump the nodes, their positions and the used names of a parse result
+static std::string dump(const yue::ParseInfo& info) {
+	std::ostringstream buf;
+	if (info.error) {
+		buf << "error: "sv << info.error->msg << ' ' << info.error->line << ':' << info.error->col << '\n';
+		return buf.str();
+	}
+	auto begin = info.codes->begin();
+	info.node->traverse([&](yue::ast_node* node) {
+		buf << node->get_name() << ' ' << (node->m_begin.m_it - begin) << '-' << (node->m_end.m_it - begin) << ' '
+			<< node->m_begin.m_line << ':' << node->m_begin.m_col << '-' << node->m_end.m_line << ':' << node->m_end.m_col << '\n';
+		return yue::traversal::Continue;
+	});
+	std::vector<std::string> names(info.usedNames.begin(), info.usedNames.end());
+	std::sort(names.begin(), names.end());
+	for (const auto& name : names) {
+		buf << name << ' ';
+	}
+	buf << '\n';
+	return buf.str();
+}
+
+// edit the codes with a reparse after each edit, comparing the results of
+// a few edits in a row with a full parse, returning the first mismatch
+static std::string checkReparse(const std::string& codes, uint32_t seed) {
+	auto& parser = yue::YueParser::shared();
+	auto next = [&]() {
+		seed = seed * 1664525u + 1013904223u;
+		return seed >> 8;
+	};
+	std::string text = codes;
+	auto info = parser.parse<yue::File_t>(text);
+	for (int i = 0; i < EDITS_PER_FILE; ++i) {
+		size_t offset = next() % (text.size() + 1);
+		size_t length = next() % 3 == 0 ? next() % std::min<size_t>(8, text.size() - offset + 1) : 0;
+		auto editText = editTexts[next() % (sizeof(editTexts) / sizeof(editTexts[0]))];
+		text.replace(offset, length, editText);
+		info = parser.reparse(std::move(info), {offset, length, editText});
+		if (!info.error && next() % 4 != 0 && i + 1 < EDITS_PER_FILE) {
+			continue;
+		}
+		auto expected = parser.parse<yue::File_t>(text);
+		if ((!info.error && *info.codes != text) || dump(info) != dump(expected)) {
+			return "reparse differs from a full parse after edit "s + std::to_string(i + 1)
+				+ " at offset "s + std::to_string(offset);
+		}
+		if (info.error) {
+			// edit the codes from a good parse again
+			text = codes;
+			info = parser.parse<yue::File_t>(text);
+		}
+	}
+	return {};
+}
+
+// parse the codes reusing the token results, returning a mismatch
+// with a parse without them
+static std::string checkTokens(const std::string& codes) {
+	yue::ParseOptions options;
+	options.reuseTokens = true;
+	auto& parser = yue::YueParser::shared();
+	if (dump(parser.parse<yue::File_t>(codes, options)) != dump(parser.parse<yue::File_t>(codes))) {
+		return "parse reusing the tokens differs from a parse without them"s;
+	}
+	return {};
+}
+
+// save the parse result of the codes to an image file and load it again
+// from the mapped file, returning a mismatch
+static std::string checkImage(const std::string& codes, const fs::path& imagePath) {
+	auto info = yue::YueParser::shared().parse<yue::File_t>(codes);
+	if (info.error) return {};
+	auto image = yue::YueParser::save(info);
+	if (image.empty()) {
+		return "failed to save the AST image"s;
+	}
+	{
+		std::ofstream output(imagePath, std::ios::out | std::ios::binary | std::ios::trunc);
+		output.write(image.data(), image.size());
+		if (!output) {
+			return "failed to write the AST image"s;
+		}
+	}
+	yue::MappedFile file(imagePath.string());
+	if (!file.isOpen() || file.data() != image) {
+		return "failed to read the AST image"s;
+	}
+	auto loaded = yue::YueParser::load(file.data());
+	if (loaded.error || *loaded.codes != codes || dump(loaded) != dump(info)
+		|| loaded.usedNameLines != info.usedNameLines || loaded.moduleName != info.moduleName
+		|| loaded.exportDefault != info.exportDefault || loaded.exportMacro != info.exportMacro
+		|| loaded.exportMetatable != info.exportMetatable) {
+		return "loaded AST image differs from the parse"s;
+	}
+	return {};
+}
+
+int main(int narg, const char** args) {
+	std::vector<fs::path> files;
+	for (int i = 1; i < narg; ++i) {
+		fs::path path(args[i]);
+		if (fs::is_directory(path)) {
+			for (const auto& item : fs::recursive_directory_iterator(path)) {
+				if (item.is_regular_file() && item.path().extension() == ".yue"sv) {
+					files.push_back(item.path());
+				}
+			}
+		} else {
+			files.push_back(path);
+		}
+	}
+	std::sort(files.begin(), files.end());
+	auto imagePath = fs::temp_directory_path() / "yue_check.img";
+	int failed = 0;
+	uint32_t seed = 0;
+	for (const auto& file : files) {
+		std::ifstream input(file, std::ios::in | std::ios::binary);
+		if (!input) {
+			std::cerr << "Failed to read file: "sv << file.string() << '\n';
+			++failed;
+			continue;
+		}
+		std::ostringstream buf;
+		buf << input.rdbuf();
+		auto codes = buf.str();
+		auto reason = checkReparse(codes, ++seed);
+		if (reason.empty()) {
+			reason = checkTokens(codes);
+		}
+		if (reason.empty()) {
+			reason = checkImage(codes, imagePath);
+		}
+		if (!reason.empty()) {
+			std::cout << file.string() << ": "sv << reason << '\n';
+			++failed;
+		}
+	}
+	std::error_code ec;
+	fs::remove(imagePath, ec);
+	std::cout << "Checked "sv << files.size() << " files, "sv << failed << " failed\n"sv;
+	return failed > 0 ? 1 : 0;
+}
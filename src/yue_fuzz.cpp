@@ -0,0 +1,151 @@
+/* Copyright (c) 2017-2025 Li Jin <dragon-fly@qq.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+// Compiles Yuescript codes looking for the inputs which are slow to compile.
+//
+// Built with libFuzzer by `make fuzz`, every input whose parse work or compile
+// time grows faster than its size aborts, so that libFuzzer saves it. A saved
+// input is minimized with `bin/fuzz/yue_fuzz -minimize_crash=1 <file>`, then
+// kept under spec/perf as a regression case, with the parse work `make perf`
+// reports for it in a "-- parse work: <steps>" comment line.
+//
+// Built with YUE_PERF_MAIN by `make perf`, it compiles the given files and the
+// files under the given directories, and fails when the parse work of one is
+// above the work recorded in it.
+
+#include "yuescript/yue_compiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+using namespace std::string_view_literals;
+using namespace std::string_literals;
+namespace fs = std::filesystem;
+
+// parse work allowed for an input, counted as the rules called plus the bytes
+// given back by backtracking, the spec inputs take less than 20 per byte
+static const size_t STEPS_PER_BYTE = 100;
+static const size_t STEPS_BASE = 10000;
+
+// compile time allowed for an input
+static const double SECONDS_PER_BYTE = 20e-6;
+static const double SECONDS_BASE = 0.5;
+
+// compile the codes within a parse budget, returning the reason when the
+// budget is spent, or when the compile time is above its limit if checked
+static std::string checkCompile(std::string_view codes, size_t budget, bool limitTime) {
+	static yue::YueCompiler compiler;
+	yue::YueConfig config;
+	config.parseBudget = budget;
+	auto start = std::chrono::steady_clock::now();
+	auto info = compiler.compile(codes, config);
+	std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+	if (info.error && info.error->msg == "parse budget exceeded"sv) {
+		return "parse work above "s + std::to_string(config.parseBudget) + " steps for "s + std::to_string(codes.size()) + " bytes"s;
+	}
+	double limit = SECONDS_PER_BYTE * codes.size() + SECONDS_BASE;
+	if (limitTime && diff.count() > limit) {
+		return "compile time "s + std::to_string(diff.count()) + "s above "s + std::to_string(limit) + "s for "s + std::to_string(codes.size()) + " bytes"s;
+	}
+	return {};
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	std::string_view codes(reinterpret_cast<const char*>(data), size);
+	auto reason = checkCompile(codes, STEPS_PER_BYTE * size + STEPS_BASE, true);
+	if (!reason.empty()) {
+		std::cerr << "slow input: "sv << reason << '\n';
+		std::abort();
+	}
+	return 0;
+}
+
+#ifdef YUE_PERF_MAIN
+// comment line of a regression case with the parse work it takes
+static const std::string_view WORK_COMMENT = "-- parse work: "sv;
+
+// get the parse work recorded in the codes, zero when there is none
+static size_t recordedWork(const std::string& codes) {
+	auto pos = codes.find(WORK_COMMENT);
+	if (pos == std::string::npos) return 0;
+	return std::strtoull(codes.c_str() + pos + WORK_COMMENT.size(), nullptr, 10);
+}
+
+// find the parse work of the codes, the least budget the parse is within,
+// the work of a parse is the same each time
+static size_t parseWork(std::string_view codes) {
+	size_t low = 1, high = STEPS_BASE;
+	while (!checkCompile(codes, high, false).empty()) {
+		low = high + 1;
+		high *= 2;
+	}
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (checkCompile(codes, mid, false).empty()) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+	return high;
+}
+
+int main(int narg, const char** args) {
+	std::vector<fs::path> files;
+	for (int i = 1; i < narg; ++i) {
+		fs::path path(args[i]);
+		if (fs::is_directory(path)) {
+			for (const auto& item : fs::recursive_directory_iterator(path)) {
+				if (item.is_regular_file() && item.path().extension() == ".yue"sv) {
+					files.push_back(item.path());
+				}
+			}
+		} else {
+			files.push_back(path);
+		}
+	}
+	std::sort(files.begin(), files.end());
+	int failed = 0;
+	for (const auto& file : files) {
+		std::ifstream input(file, std::ios::in | std::ios::binary);
+		if (!input) {
+			std::cerr << "Failed to read file: "sv << file.string() << '\n';
+			++failed;
+			continue;
+		}
+		std::ostringstream buf;
+		buf << input.rdbuf();
+		auto codes = buf.str();
+		size_t work = recordedWork(codes);
+		if (work == 0) {
+			std::cout << file.string() << ": no parse work recorded, the parse takes "sv << parseWork(codes) << " steps\n"sv;
+			++failed;
+			continue;
+		}
+		auto start = std::chrono::steady_clock::now();
+		auto reason = checkCompile(codes, work, false);
+		std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+		if (reason.empty()) {
+			std::cout << file.string() << ": "sv << diff.count() * 1000.0 << " ms\n"sv;
+		} else {
+			std::cout << file.string() << ": "sv << reason << ", the parse takes "sv << parseWork(codes) << " steps\n"sv;
+			++failed;
+		}
+	}
+	return failed > 0 ? 1 : 0;
+}
+#endif // YUE_PERF_MAIN
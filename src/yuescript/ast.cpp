@@ -9,14 +9,170 @@ Redistributions in binary form must reproduce the above copyright notice, this l
 
 THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
 
+#include <algorithm>
 #include <cassert>
+#include <cstddef>
+#include <cstring>
 
 #include "yuescript/ast.hpp"
 
 namespace parserlib {
 
+// size of the chunks, doubled up to the max size
+static const size_t _ARENA_CHUNK_SIZE = 16 * 1024;
+static const size_t _ARENA_MAX_CHUNK_SIZE = 1024 * 1024;
+
+// space before a node, keeping the arena of the node
+static const size_t _NODE_HEADER = alignof(ast_node);
+static_assert(_NODE_HEADER >= sizeof(ast_arena*), "no room for the arena of a node");
+
+static thread_local ast_arena* _current_arena = nullptr;
+
+std::shared_ptr<ast_arena> ast_arena::make() {
+	return std::shared_ptr<ast_arena>(new ast_arena, &ast_arena::close);
+}
+
+ast_arena::~ast_arena() {
+	for (char* chunk : m_chunks) {
+		delete[] chunk;
+	}
+}
+
+void ast_arena::close(ast_arena* arena) {
+	arena->m_closed = true;
+	if (arena->m_nodes == 0) {
+		delete arena;
+	}
+}
+
+ast_arena::scope::scope(ast_arena* arena)
+	: m_prev(_current_arena) {
+	_current_arena = arena;
+}
+
+ast_arena::scope::~scope() {
+	_current_arena = m_prev;
+}
+
+ast_arena* ast_arena::current() {
+	return _current_arena;
+}
+
+void* ast_arena::allocate(size_t size) {
+	size = (size + _NODE_HEADER - 1) & ~(_NODE_HEADER - 1);
+	if (static_cast<size_t>(m_end - m_ptr) < size) {
+		m_chunk_size = m_chunk_size == 0 ? _ARENA_CHUNK_SIZE : std::min(m_chunk_size * 2, _ARENA_MAX_CHUNK_SIZE);
+		size_t chunk_size = std::max(m_chunk_size, size);
+		char* chunk = new char[chunk_size];
+		m_chunks.push_back(chunk);
+		m_ptr = chunk;
+		m_end = chunk + chunk_size;
+	}
+	void* mem = m_ptr;
+	m_ptr += size;
+	++m_nodes;
+	return mem;
+}
+
+void ast_arena::free() {
+	assert(m_nodes > 0);
+	if (--m_nodes == 0 && m_closed) {
+		delete this;
+	}
+}
+
+void* ast_node::operator new(size_t size) {
+	ast_arena* arena = ast_arena::current();
+	char* mem = static_cast<char*>(arena ? arena->allocate(size + _NODE_HEADER) : ::operator new(size + _NODE_HEADER));
+	*reinterpret_cast<ast_arena**>(mem) = arena;
+	return mem + _NODE_HEADER;
+}
+
+void ast_node::operator delete(void* ptr) {
+	char* mem = static_cast<char*>(ptr) - _NODE_HEADER;
+	ast_arena* arena = *reinterpret_cast<ast_arena**>(mem);
+	if (arena) {
+		arena->free();
+	} else {
+		::operator delete(mem);
+	}
+}
+
+ast_stack::~ast_stack() {
+	truncate(0);
+	for (ast_node* node : m_kept) {
+		node->release();
+	}
+}
+
+void ast_stack::truncate(size_t size) {
+	while (m_nodes.size() > size) {
+		ast_node* node = m_nodes.back();
+		m_nodes.pop_back();
+		// deletes the node unless it is kept
+		node->retain();
+		node->release();
+	}
+}
+
+void* ast_stack::keep(size_t index) {
+	assert(index < m_nodes.size());
+	ast_node* node = m_nodes[index];
+	node->retain();
+	m_kept.push_back(node);
+	return node;
+}
+
+void ast_stack::push_kept(void* handle) {
+	m_nodes.push_back(static_cast<ast_node*>(handle));
+}
+
+ast_node* ast_stack::take_back() {
+	ast_node* node = m_nodes.back();
+	m_nodes.pop_back();
+	for (size_t i = m_kept.size(); i-- > 0;) {
+		if (m_kept[i] == node) {
+			m_kept.erase(m_kept.begin() + i);
+			--node->_ref;
+		}
+	}
+	return node;
+}
+
+void node_container::reserve(size_t capacity) {
+	if (capacity <= m_capacity) return;
+	capacity = std::max(capacity, m_capacity * 2);
+	ast_node** data = new ast_node*[capacity];
+	std::copy(begin(), end(), data);
+	if (m_data != m_inline) delete[] m_data;
+	m_data = data;
+	m_capacity = capacity;
+}
+
+void node_container::swap(node_container& other) noexcept {
+	if (m_data != m_inline && other.m_data != other.m_inline) {
+		std::swap(m_data, other.m_data);
+		std::swap(m_capacity, other.m_capacity);
+	} else if (m_data != m_inline) {
+		std::copy(other.begin(), other.end(), m_inline);
+		other.m_data = m_data;
+		other.m_capacity = m_capacity;
+		m_data = m_inline;
+		m_capacity = InlineSize;
+	} else if (other.m_data != other.m_inline) {
+		std::copy(begin(), end(), other.m_inline);
+		m_data = other.m_data;
+		m_capacity = other.m_capacity;
+		other.m_data = other.m_inline;
+		other.m_capacity = InlineSize;
+	} else {
+		std::swap(m_inline, other.m_inline);
+	}
+	std::swap(m_size, other.m_size);
+}
+
 traversal ast_node::traverse(const std::function<traversal(ast_node*)>& func) {
-	return func(this);
+	return traverse<const std::function<traversal(ast_node*)>&>(func);
 }
 
 ast_node* ast_node::get_by_type_ids(int* begin, int* end) {
@@ -43,8 +199,23 @@ ast_node* ast_node::get_by_type_ids(int* begin, int* end) {
 	return current;
 }
 
-bool ast_node::visit_child(const std::function<bool(ast_node*)>&) {
-	return false;
+bool ast_node::visit_child(const std::function<bool(ast_node*)>& func) {
+	return visit_child<const std::function<bool(ast_node*)>&>(func);
+}
+
+const ast_member_table& ast_node::members() const {
+	static const ast_member_table table;
+	return table;
+}
+
+ast_member_table ast_container::make_members(const ast_container* node, std::initializer_list<const ast_member*> members) {
+	ast_member_table table;
+	table.reserve(members.size());
+	for (auto member : members) {
+		size_t offset = reinterpret_cast<const char*>(member) - reinterpret_cast<const char*>(node);
+		table.push_back({offset, member->get_type()});
+	}
+	return table;
 }
 
 /** Asks all members to construct themselves from the stack.
@@ -53,68 +224,201 @@ bool ast_node::visit_child(const std::function<bool(ast_node*)>&) {
 	@param st stack.
 */
 void ast_container::construct(ast_stack& st) {
-	for (ast_member_vector::reverse_iterator it = m_members.rbegin();
-		it != m_members.rend();
-		++it) {
-		ast_member* member = *it;
-		member->construct(st);
+	const auto& members = this->members();
+	for (auto it = members.rbegin(); it != members.rend(); ++it) {
+		member_at(it->offset)->construct(st);
 	}
 }
 
-traversal ast_container::traverse(const std::function<traversal(ast_node*)>& func) {
-	traversal action = func(this);
-	switch (action) {
-		case traversal::Stop: return traversal::Stop;
-		case traversal::Return: return traversal::Continue;
-		default: break;
+// header of an AST image
+struct _ast_image_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t codes_size;
+	uint32_t extra_size;
+	uint32_t reserved;
+};
+
+static const uint32_t _AST_IMAGE_MAGIC = 0x54534159; // "YAST" in little endian
+static const uint32_t _AST_IMAGE_VERSION = 2;
+
+std::string ast_image::save(ast_node* root, const input& codes, std::string_view extra) {
+	if (!root || codes.size() > UINT32_MAX || extra.size() > UINT32_MAX) return {};
+	std::vector<ast_record> records;
+	std::vector<size_t> parents;
+	// nodes to write with the index of their parent
+	std::vector<std::pair<ast_node*, size_t>> stack;
+	stack.emplace_back(root, 0);
+	node_container children;
+	while (!stack.empty()) {
+		auto [node, parent] = stack.back();
+		stack.pop_back();
+		auto begin = node->m_begin.m_it - codes.begin();
+		auto end = node->m_end.m_it - codes.begin();
+		if (begin < 0 || begin > end || end > static_cast<decltype(end)>(codes.size())) {
+			return {};
+		}
+		ast_record record;
+		record.begin = static_cast<uint32_t>(begin);
+		record.end = static_cast<uint32_t>(end);
+		record.size = 1;
+		record.id = static_cast<uint16_t>(node->get_id());
+		record.reserved = 0;
+		size_t index = records.size();
+		records.push_back(record);
+		parents.push_back(parent);
+		children.clear();
+		node->visit_child([&](ast_node* child) {
+			children.push_back(child);
+			return false;
+		});
+		for (auto it = children.rbegin(); it != children.rend(); ++it) {
+			stack.emplace_back(*it, index);
+		}
 	}
-	const auto& members = this->members();
-	for (auto member : members) {
-		switch (member->get_type()) {
-			case ast_holder_type::Pointer: {
-				_ast_ptr* ptr = static_cast<_ast_ptr*>(member);
-				if (ptr->get() && ptr->get()->traverse(func) == traversal::Stop) {
-					return traversal::Stop;
-				}
-				break;
-			}
-			case ast_holder_type::List: {
-				_ast_list* list = static_cast<_ast_list*>(member);
-				for (auto obj : list->objects()) {
-					if (obj->traverse(func) == traversal::Stop) {
-						return traversal::Stop;
-					}
-				}
-				break;
-			}
+	if (records.size() > UINT32_MAX) return {};
+	for (size_t i = records.size() - 1; i > 0; --i) {
+		records[parents[i]].size += records[i].size;
+	}
+	_ast_image_header header;
+	header.magic = _AST_IMAGE_MAGIC;
+	header.version = _AST_IMAGE_VERSION;
+	header.count = static_cast<uint32_t>(records.size());
+	header.codes_size = static_cast<uint32_t>(codes.size());
+	header.extra_size = static_cast<uint32_t>(extra.size());
+	header.reserved = 0;
+	std::string data;
+	data.reserve(sizeof(header) + records.size() * sizeof(ast_record) + codes.size() + extra.size());
+	data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+	data.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(ast_record));
+	data.append(codes);
+	data.append(extra);
+	return data;
+}
+
+bool ast_image::open(std::string_view data) {
+	m_records = nullptr;
+	m_count = 0;
+	m_codes = {};
+	m_extra = {};
+	_ast_image_header header;
+	if (data.size() < sizeof(header) || reinterpret_cast<uintptr_t>(data.data()) % alignof(ast_record) != 0) {
+		return false;
+	}
+	std::memcpy(&header, data.data(), sizeof(header));
+	if (header.magic != _AST_IMAGE_MAGIC || header.version != _AST_IMAGE_VERSION || header.count == 0) {
+		return false;
+	}
+	uint64_t records_size = uint64_t{header.count} * sizeof(ast_record);
+	if (data.size() != sizeof(header) + records_size + header.codes_size + header.extra_size) {
+		return false;
+	}
+	auto records = reinterpret_cast<const ast_record*>(data.data() + sizeof(header));
+	if (records[0].size != header.count) return false;
+	for (size_t i = 0; i < header.count; ++i) {
+		const auto& record = records[i];
+		if (record.size == 0 || record.size > header.count - i || record.begin > record.end || record.end > header.codes_size) {
+			return false;
 		}
 	}
-	return traversal::Continue;
+	m_records = records;
+	m_count = header.count;
+	m_codes = data.substr(sizeof(header) + records_size, header.codes_size);
+	m_extra = data.substr(sizeof(header) + records_size + header.codes_size);
+	return true;
 }
 
-bool ast_container::visit_child(const std::function<bool(ast_node*)>& func) {
-	const auto& members = this->members();
-	for (auto member : members) {
-		switch (member->get_type()) {
-			case ast_holder_type::Pointer: {
-				_ast_ptr* ptr = static_cast<_ast_ptr*>(member);
-				if (ptr->get()) {
-					if (func(ptr->get())) return true;
-				}
-				break;
+// finds the lines and the columns of offsets in the codes, an offset on
+// the line of the last one found is counted from it, so the offsets
+// found in order take a single pass over the codes
+class _ast_locator {
+public:
+	_ast_locator(input& codes)
+		: m_codes(codes) {
+		m_starts.push_back(0);
+		const char* data = codes.data();
+		const char* end = data + codes.size();
+		for (const char* it = data; (it = static_cast<const char*>(std::memchr(it, '\n', end - it)));) {
+			++it;
+			m_starts.push_back(static_cast<size_t>(it - data));
+		}
+	}
+
+	void locate(size_t off, pos& p) {
+		if (off < m_off || (m_index + 1 < m_starts.size() && off >= m_starts[m_index + 1])) {
+			m_index = std::upper_bound(m_starts.begin(), m_starts.end(), off) - m_starts.begin() - 1;
+			m_off = m_starts[m_index];
+			m_col = 1;
+		}
+		// continuation bytes of a code point take no column
+		for (; m_off < off; ++m_off) {
+			if ((static_cast<unsigned char>(m_codes[m_off]) & 0xC0) != 0x80) {
+				++m_col;
 			}
-			case ast_holder_type::List: {
-				_ast_list* list = static_cast<_ast_list*>(member);
-				for (auto obj : list->objects()) {
-					if (obj) {
-						if (func(obj)) return true;
-					}
-				}
-				break;
+		}
+		p.m_it = m_codes.begin() + off;
+		p.m_line = static_cast<int>(m_index) + 1;
+		p.m_col = m_col;
+	}
+
+private:
+	input& m_codes;
+	std::vector<size_t> m_starts;
+	size_t m_index = 0;
+	size_t m_off = 0;
+	int m_col = 1;
+};
+
+ast_node* ast_image::load(ast_node* (*create)(int id), input& codes) const {
+	if (m_count == 0 || codes.size() != m_codes.size()) return nullptr;
+	// the begins are found in pre order and the ends in post order,
+	// the orders the offsets mostly grow in
+	_ast_locator begins(codes);
+	_ast_locator ends(codes);
+	// the nodes are created in post order, each taking its children from
+	// the stack, just like the parser does
+	ast_stack st;
+	auto finish = [&](size_t index, const pos& begin) {
+		const auto& record = m_records[index];
+		ast_node* node = create(record.id);
+		if (!node) {
+			throw std::logic_error("Invalid AST node.");
+		}
+		node->m_begin = begin;
+		ends.locate(record.end, node->m_end);
+		try {
+			node->construct(st);
+		} catch (...) {
+			delete node;
+			throw;
+		}
+		st.push_back(node);
+	};
+	try {
+		std::vector<std::pair<size_t, pos>> parents;
+		pos begin;
+		for (size_t i = 0; i < m_count; ++i) {
+			while (!parents.empty() && i >= parents.back().first + m_records[parents.back().first].size) {
+				finish(parents.back().first, parents.back().second);
+				parents.pop_back();
+			}
+			begins.locate(m_records[i].begin, begin);
+			if (m_records[i].size > 1) {
+				parents.emplace_back(i, begin);
+			} else {
+				finish(i, begin);
 			}
 		}
+		while (!parents.empty()) {
+			finish(parents.back().first, parents.back().second);
+			parents.pop_back();
+		}
+	} catch (const std::logic_error&) {
+		return nullptr;
 	}
-	return false;
+	if (st.size() != 1) return nullptr;
+	return st.take_back();
 }
 
 /** parses the given input.
@@ -122,20 +426,17 @@ bool ast_container::visit_child(const std::function<bool(ast_node*)>& func) {
 	@param g root rule of grammar.
 	@param el list of errors.
 	@param ud user data, passed to the parse procedures.
+	@param opt optional parsing features.
 	@return pointer to ast node created, or null if there was an error.
 		The return object must be deleted by the caller.
 */
-ast_node* parse(input& i, rule& g, error_list& el, void* ud) {
+ast_node* parse(input& i, rule& g, error_list& el, void* ud, const parse_options& opt) {
 	ast_stack st;
-	if (!parse(i, g, el, &st, ud)) {
-		for (auto node : st) {
-			delete node;
-		}
-		st.clear();
+	if (!parse(i, g, el, &st, ud, opt)) {
 		return nullptr;
 	}
 	assert(st.size() == 1);
-	return st.front();
+	return st.take_back();
 }
 
 /** check if the start part of given input matches grammar.
@@ -144,19 +445,16 @@ ast_node* parse(input& i, rule& g, error_list& el, void* ud) {
 	@param i input.
 	@param g root rule of grammar.
 	@param ud user data, passed to the parse procedures.
+	@param opt optional parsing features.
 	@return true on parsing success, false on failure.
 */
-ast_node* start_with(input& i, rule& g, error_list& el, void* ud) {
+ast_node* start_with(input& i, rule& g, error_list& el, void* ud, const parse_options& opt) {
 	ast_stack st;
-	if (!start_with(i, g, el, &st, ud)) {
-		for (auto node : st) {
-			delete node;
-		}
-		st.clear();
+	if (!start_with(i, g, el, &st, ud, opt)) {
 		return nullptr;
 	}
 	assert(st.size() == 1);
-	return st.front();
+	return st.take_back();
 }
 
 } // namespace parserlib
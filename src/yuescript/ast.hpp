@@ -11,8 +11,12 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 
 #pragma once
 
+#include <algorithm>
 #include <cassert>
-#include <list>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
 #include <stdexcept>
 #include <string_view>
 #include <type_traits>
@@ -24,6 +28,7 @@ namespace parserlib {
 using namespace std::string_view_literals;
 
 class ast_node;
+class ast_member;
 template <bool Required, class T>
 class ast_ptr;
 template <bool Required, class T>
@@ -31,10 +36,241 @@ class ast_list;
 template <class T>
 class ast;
 
-/** type of AST node stack.
+/** bump allocator of the AST nodes.
+	The nodes created while a scope of the arena is open take their memory
+	from it. Deleting a node gives nothing back; the whole memory is freed
+	at once when the owner has closed the arena and its last node is deleted.
+	An arena is used by one thread at a time.
+ */
+class ast_arena {
+public:
+	/** creates an arena, closed when the returned owner is released.
+		@return the owner of the arena.
+	*/
+	static std::shared_ptr<ast_arena> make();
+
+	/// makes the arena the one of the nodes created by this thread.
+	class scope {
+	public:
+		scope(ast_arena* arena);
+		~scope();
+
+	private:
+		ast_arena* m_prev;
+	};
+
+	/// returns the arena of the nodes created by this thread, or null.
+	static ast_arena* current();
+
+	/** allocates memory for a node.
+		@param size size of the memory.
+		@return the memory.
+	*/
+	void* allocate(size_t size);
+
+	/// gives back the memory of a node.
+	void free();
+
+private:
+	ast_arena() { }
+	~ast_arena();
+
+	// frees the arena once it is closed and holds no more node
+	static void close(ast_arena* arena);
+
+	std::vector<char*> m_chunks;
+	char* m_ptr = nullptr;
+	char* m_end = nullptr;
+	size_t m_chunk_size = 0;
+	size_t m_nodes = 0;
+	bool m_closed = false;
+};
+
+/** AST node stack, the nodes are built on it while parsing.
+	The nodes left on the stack are deleted with it, and so are
+	the kept nodes which no other node took.
+ */
+class ast_stack : public parse_stack {
+public:
+	virtual ~ast_stack();
+
+	bool empty() const { return m_nodes.empty(); }
+
+	virtual size_t size() const override { return m_nodes.size(); }
+
+	ast_node* back() const { return m_nodes.back(); }
+
+	void push_back(ast_node* node) { m_nodes.push_back(node); }
+
+	void pop_back() { m_nodes.pop_back(); }
+
+	/** pops the node on the top, which is then owned by the caller
+		instead of being deleted with the stack.
+		@return the node.
+	*/
+	ast_node* take_back();
+
+	/** deletes the nodes above the given size.
+		@param size size to truncate the stack to.
+	*/
+	virtual void truncate(size_t size) override;
+
+	/** retains the node at the given index until the stack is deleted.
+		@param index index of the node.
+		@return the node.
+	*/
+	virtual void* keep(size_t index) override;
+
+	/** pushes a kept node again.
+		@param handle the node.
+	*/
+	virtual void push_kept(void* handle) override;
+
+private:
+	std::vector<ast_node*> m_nodes;
+	std::vector<ast_node*> m_kept;
+};
+
+/** contiguous list of nodes.
+	The first few nodes are kept inside the container itself, so the short
+	lists most AST nodes hold take no extra allocation. Iterators are plain
+	pointers and are invalidated by any change to the size.
  */
-typedef std::vector<ast_node*> ast_stack;
-typedef std::list<ast_node*> node_container;
+class node_container {
+public:
+	typedef ast_node* value_type;
+	typedef ast_node** iterator;
+	typedef ast_node* const* const_iterator;
+	typedef std::reverse_iterator<iterator> reverse_iterator;
+	typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+	node_container()
+		: m_data(m_inline) { }
+
+	node_container(std::initializer_list<ast_node*> nodes)
+		: node_container() {
+		insert(end(), nodes.begin(), nodes.end());
+	}
+
+	template <class It>
+	node_container(It first, It last)
+		: node_container() {
+		insert(end(), first, last);
+	}
+
+	node_container(const node_container& other)
+		: node_container() {
+		insert(end(), other.begin(), other.end());
+	}
+
+	node_container(node_container&& other) noexcept
+		: node_container() {
+		swap(other);
+	}
+
+	~node_container() {
+		if (m_data != m_inline) delete[] m_data;
+	}
+
+	node_container& operator=(const node_container& other) {
+		if (this != &other) {
+			clear();
+			insert(end(), other.begin(), other.end());
+		}
+		return *this;
+	}
+
+	node_container& operator=(node_container&& other) noexcept {
+		if (this != &other) {
+			clear();
+			swap(other);
+		}
+		return *this;
+	}
+
+	iterator begin() { return m_data; }
+	iterator end() { return m_data + m_size; }
+	const_iterator begin() const { return m_data; }
+	const_iterator end() const { return m_data + m_size; }
+	const_iterator cbegin() const { return begin(); }
+	const_iterator cend() const { return end(); }
+	reverse_iterator rbegin() { return reverse_iterator(end()); }
+	reverse_iterator rend() { return reverse_iterator(begin()); }
+	const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+	const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+	size_t size() const { return m_size; }
+	bool empty() const { return m_size == 0; }
+
+	ast_node*& operator[](size_t index) { return m_data[index]; }
+	ast_node* operator[](size_t index) const { return m_data[index]; }
+	ast_node*& front() { return m_data[0]; }
+	ast_node* front() const { return m_data[0]; }
+	ast_node*& back() { return m_data[m_size - 1]; }
+	ast_node* back() const { return m_data[m_size - 1]; }
+
+	void push_back(ast_node* node) {
+		if (m_size == m_capacity) reserve(m_size + 1);
+		m_data[m_size++] = node;
+	}
+
+	void push_front(ast_node* node) {
+		insert(begin(), node);
+	}
+
+	void pop_back() {
+		--m_size;
+	}
+
+	void pop_front() {
+		erase(begin());
+	}
+
+	void clear() {
+		m_size = 0;
+	}
+
+	/** makes room for the given number of nodes.
+		@param capacity number of nodes.
+	*/
+	void reserve(size_t capacity);
+
+	iterator insert(const_iterator pos, ast_node* node) {
+		return insert(pos, &node, &node + 1);
+	}
+
+	template <class It>
+	iterator insert(const_iterator pos, It first, It last) {
+		size_t index = pos - m_data;
+		size_t count = std::distance(first, last);
+		if (m_size + count > m_capacity) reserve(m_size + count);
+		iterator it = m_data + index;
+		std::move_backward(it, end(), end() + count);
+		std::copy(first, last, it);
+		m_size += count;
+		return it;
+	}
+
+	iterator erase(const_iterator pos) {
+		return erase(pos, pos + 1);
+	}
+
+	iterator erase(const_iterator first, const_iterator last) {
+		iterator it = m_data + (first - m_data);
+		std::move(it + (last - first), end(), it);
+		m_size -= last - first;
+		return it;
+	}
+
+	void swap(node_container& other) noexcept;
+
+private:
+	enum : size_t { InlineSize = 4 };
+	ast_node** m_data;
+	size_t m_size = 0;
+	size_t m_capacity = InlineSize;
+	ast_node* m_inline[InlineSize];
+};
 
 template <size_t Num>
 struct Counter {
@@ -62,12 +298,44 @@ enum class traversal {
 	Stop
 };
 
+enum class ast_holder_type {
+	Pointer,
+	List
+};
+
+/** place of an AST member inside its container.
+ */
+struct ast_member_info {
+	size_t offset;
+	ast_holder_type type;
+};
+
+/** type of ast member table, describing the members of a node type.
+ */
+typedef std::vector<ast_member_info> ast_member_table;
+
 /** Base class for AST nodes.
+	The header of a node is the vtable pointer, the begin and end positions
+	and the reference count along with the 16-bit type id. The positions are
+	kept as iterators with their lines and columns, since the compiler makes
+	nodes from generated codes that point into other buffers than the parsed
+	codes and take the line and column of the node they stand for.
  */
 class ast_node : public input_range {
 public:
-	ast_node()
-		: _ref(0) { }
+	/** constructor.
+		@param id type id of the node.
+	*/
+	explicit ast_node(int id)
+		: _ref(0)
+		, _id(static_cast<uint16_t>(id)) {
+		assert(id >= 0 && id <= UINT16_MAX);
+	}
+
+	/// allocates the node in the arena of the thread, if there is one.
+	static void* operator new(size_t size);
+
+	static void operator delete(void* ptr);
 
 	void retain() {
 		++_ref;
@@ -90,6 +358,14 @@ public:
 	 */
 	virtual traversal traverse(const std::function<traversal(ast_node*)>& func);
 
+	/** visits the node and its descendants in depth-first order,
+		without recursion and without type erasing the visitor.
+		@param func visitor returning a traversal action.
+		@return traversal::Stop if the visitor stopped the traversal.
+	*/
+	template <class F>
+	traversal traverse(F&& func);
+
 	template <typename... Ts>
 	struct select_last {
 		using type = typename decltype((std::enable_if<true, Ts>{}, ...))::type;
@@ -105,7 +381,33 @@ public:
 
 	virtual bool visit_child(const std::function<bool(ast_node*)>& func);
 
-	virtual int get_id() const = 0;
+	/** visits the children of the node until the visitor returns true.
+		@param func visitor.
+		@return true if the visitor returned true.
+	*/
+	template <class F>
+	bool visit_child(F&& func);
+
+	/** returns the table of AST members, shared by the nodes of a type.
+		@return the table of AST members.
+	*/
+	virtual const ast_member_table& members() const;
+
+	/** returns the AST member at an offset of the member table.
+		@param offset offset of the member.
+		@return the AST member.
+	*/
+	ast_member* member_at(size_t offset) {
+		return reinterpret_cast<ast_member*>(reinterpret_cast<char*>(this) + offset);
+	}
+
+	/** returns the type id of the node, kept in the node so that the
+		type checks need no virtual call.
+		@return the type id.
+	*/
+	int get_id() const {
+		return _id;
+	}
 
 	virtual const std::string_view get_name() const = 0;
 
@@ -123,9 +425,13 @@ public:
 
 private:
 	int _ref;
+	uint16_t _id;
 	ast_node* get_by_type_ids(int* begin, int* end);
+	friend class ast_stack;
 };
 
+static_assert(sizeof(ast_node) <= sizeof(input_range) + sizeof(int) * 2, "AST node header grown");
+
 template <class T>
 constexpr typename std::enable_if<std::is_base_of<ast_node, T>::value, int>::type
 id() { return 0; }
@@ -151,28 +457,12 @@ bool ast_is(ast_node* node) {
 	return result;
 }
 
-class ast_member;
-
-/** type of ast member vector.
- */
-typedef std::vector<ast_member*> ast_member_vector;
-
 /** base class for AST nodes with children.
  */
 class ast_container : public ast_node {
 public:
-	void add_members(std::initializer_list<ast_member*> members) {
-		for (auto member : members) {
-			m_members.push_back(member);
-		}
-	}
-
-	/** returns the vector of AST members.
-		@return the vector of AST members.
-	*/
-	const ast_member_vector& members() const {
-		return m_members;
-	}
+	explicit ast_container(int id)
+		: ast_node(id) { }
 
 	/** Asks all members to construct themselves from the stack.
 		The members are asked to construct themselves in reverse order.
@@ -181,19 +471,13 @@ public:
 	*/
 	virtual void construct(ast_stack& st) override;
 
-	virtual traversal traverse(const std::function<traversal(ast_node*)>& func) override;
-
-	virtual bool visit_child(const std::function<bool(ast_node*)>& func) override;
-
-private:
-	ast_member_vector m_members;
-
-	friend class ast_member;
-};
-
-enum class ast_holder_type {
-	Pointer,
-	List
+protected:
+	/** builds the member table of a node type.
+		@param node a node of the type.
+		@param members the members of the node.
+		@return the member table.
+	*/
+	static ast_member_table make_members(const ast_container* node, std::initializer_list<const ast_member*> members);
 };
 
 /** Base class for children of ast_container.
@@ -449,6 +733,22 @@ public:
 		return m_objects;
 	}
 
+	/** replaces a range of the objects with other objects.
+		@param first first object replaced.
+		@param last object after the last one replaced.
+		@param nodes objects to insert.
+	*/
+	void replace(node_container::const_iterator first, node_container::const_iterator last, const node_container& nodes) {
+		for (ast_node* node : nodes) {
+			assert(node && accept(node));
+			node->retain();
+		}
+		for (auto it = first; it != last; ++it) {
+			(*it)->release();
+		}
+		m_objects.insert(m_objects.erase(first, last), nodes.begin(), nodes.end());
+	}
+
 	void clear() {
 		for (ast_node* obj : m_objects) {
 			if (obj) obj->release();
@@ -503,13 +803,14 @@ public:
 				if (Required && m_objects.empty()) {
 					throw std::logic_error("Invalid AST node.");
 				}
-				return;
+				break;
 			}
 			st.pop_back();
-			// insert the object in the list, in reverse order
-			m_objects.push_front(node);
+			// the objects are popped in reverse order
+			m_objects.push_back(node);
 			node->retain();
 		}
+		std::reverse(m_objects.begin(), m_objects.end());
 		if (Required && m_objects.empty()) {
 			throw std::logic_error("Invalid AST stack.");
 		}
@@ -543,12 +844,13 @@ public:
 				if (Required && m_objects.empty()) {
 					throw std::logic_error("Invalid AST node.");
 				}
-				return;
+				break;
 			}
 			st.pop_back();
-			m_objects.push_front(node);
+			m_objects.push_back(node);
 			node->retain();
 		}
+		std::reverse(m_objects.begin(), m_objects.end());
 		if (Required && m_objects.empty()) {
 			throw std::logic_error("Invalid AST stack.");
 		}
@@ -564,6 +866,63 @@ private:
 	}
 };
 
+template <class F>
+traversal ast_node::traverse(F&& func) {
+	node_container stack;
+	stack.push_back(this);
+	while (!stack.empty()) {
+		ast_node* node = stack.back();
+		stack.pop_back();
+		switch (func(node)) {
+			case traversal::Stop: return traversal::Stop;
+			case traversal::Return: continue;
+			default: break;
+		}
+		// push the children in reverse order, so they are visited in order
+		const auto& members = node->members();
+		for (auto it = members.rbegin(); it != members.rend(); ++it) {
+			ast_member* member = node->member_at(it->offset);
+			switch (it->type) {
+				case ast_holder_type::Pointer: {
+					if (ast_node* child = static_cast<_ast_ptr*>(member)->get()) {
+						stack.push_back(child);
+					}
+					break;
+				}
+				case ast_holder_type::List: {
+					const auto& objects = static_cast<_ast_list*>(member)->objects();
+					for (auto obj = objects.rbegin(); obj != objects.rend(); ++obj) {
+						if (*obj) stack.push_back(*obj);
+					}
+					break;
+				}
+			}
+		}
+	}
+	return traversal::Continue;
+}
+
+template <class F>
+bool ast_node::visit_child(F&& func) {
+	for (const auto& info : members()) {
+		ast_member* member = member_at(info.offset);
+		switch (info.type) {
+			case ast_holder_type::Pointer: {
+				ast_node* child = static_cast<_ast_ptr*>(member)->get();
+				if (child && func(child)) return true;
+				break;
+			}
+			case ast_holder_type::List: {
+				for (ast_node* obj : static_cast<_ast_list*>(member)->objects()) {
+					if (obj && func(obj)) return true;
+				}
+				break;
+			}
+		}
+	}
+	return false;
+}
+
 /** AST function which creates an object of type T
 	and pushes it to the node stack.
 */
@@ -580,7 +939,7 @@ public:
 private:
 	// parse proc
 	static void _parse_proc(const pos& b, const pos& e, void* d) {
-		ast_stack* st = reinterpret_cast<ast_stack*>(d);
+		ast_stack* st = static_cast<ast_stack*>(reinterpret_cast<parse_stack*>(d));
 		T* obj = new T;
 		obj->m_begin = b;
 		obj->m_end = e;
@@ -589,15 +948,133 @@ private:
 	}
 };
 
+/** node of the binary AST image.
+ */
+struct ast_record {
+	/// offsets of the node in the codes.
+	uint32_t begin;
+	uint32_t end;
+
+	/// count of the nodes in the subtree of the node, the node included.
+	uint32_t size;
+
+	/// type id of the node.
+	uint16_t id;
+
+	uint16_t reserved;
+};
+
+/** AST kept in a binary image, read in place.
+	The image holds a header, the nodes in pre order, the codes the AST was
+	parsed from and extra bytes kept for the caller. The first child of a
+	node follows it and every other child follows the subtree of the
+	previous one, so the tree is walked without allocating. The lines and
+	the columns of the nodes are not kept, they are found from the codes
+	when the nodes are loaded. The image is in the byte order of the
+	machine that wrote it.
+ */
+class ast_image {
+public:
+	/** node of the image.
+	 */
+	class node {
+	public:
+		node(const ast_image* image, size_t index)
+			: m_image(image)
+			, m_index(index) { }
+
+		size_t index() const {
+			return m_index;
+		}
+
+		const ast_record& record() const {
+			return m_image->m_records[m_index];
+		}
+
+		int id() const {
+			return record().id;
+		}
+
+		/// returns the codes of the node.
+		std::string_view text() const {
+			return m_image->m_codes.substr(record().begin, record().end - record().begin);
+		}
+
+		/** visits the children of the node until the visitor returns true.
+			@param func visitor.
+			@return true if the visitor returned true.
+		*/
+		template <class F>
+		bool visit_child(F&& func) const {
+			size_t last = m_index + record().size;
+			for (size_t i = m_index + 1; i < last; i += m_image->m_records[i].size) {
+				if (func(node(m_image, i))) return true;
+			}
+			return false;
+		}
+
+	private:
+		const ast_image* m_image;
+		size_t m_index;
+	};
+
+	/** writes an AST to an image.
+		@param root root of the AST.
+		@param codes the codes the AST was parsed from.
+		@param extra bytes kept along the AST for the caller.
+		@return the image, empty if a node lies outside of the codes.
+	*/
+	static std::string save(ast_node* root, const input& codes, std::string_view extra = {});
+
+	/** opens an image, checking its header and nodes.
+		The bytes are not copied and must outlive the image.
+		@param data bytes of the image.
+		@return true if the bytes hold a valid image.
+	*/
+	bool open(std::string_view data);
+
+	/// returns the count of the nodes.
+	size_t size() const {
+		return m_count;
+	}
+
+	node root() const {
+		return node(this, 0);
+	}
+
+	std::string_view codes() const {
+		return m_codes;
+	}
+
+	std::string_view extra() const {
+		return m_extra;
+	}
+
+	/** creates the AST nodes of the image.
+		@param create function creating an empty node of a type id, or null
+			for an unknown id.
+		@param codes copy of the codes of the image, the nodes point into it.
+		@return the root node, or null if the nodes do not form a valid AST.
+	*/
+	ast_node* load(ast_node* (*create)(int id), input& codes) const;
+
+private:
+	const ast_record* m_records = nullptr;
+	size_t m_count = 0;
+	std::string_view m_codes;
+	std::string_view m_extra;
+};
+
 /** parses the given input.
 	@param i input.
 	@param g root rule of grammar.
 	@param el list of errors.
 	@param ud user data, passed to the parse procedures.
+	@param opt optional parsing features.
 	@return pointer to ast node created, or null if there was an error.
 		The return object must be deleted by the caller.
 */
-ast_node* parse(input& i, rule& g, error_list& el, void* ud);
+ast_node* parse(input& i, rule& g, error_list& el, void* ud, const parse_options& opt = {});
 
 /** check if the start part of given input matches grammar.
 	The parse procedures of each rule parsed are executed
@@ -605,8 +1082,9 @@ ast_node* parse(input& i, rule& g, error_list& el, void* ud);
 	@param i input.
 	@param g root rule of grammar.
 	@param ud user data, passed to the parse procedures.
+	@param opt optional parsing features.
 	@return true on parsing success, false on failure.
 */
-ast_node* start_with(input& i, rule& g, error_list& el, void* ud);
+ast_node* start_with(input& i, rule& g, error_list& el, void* ud, const parse_options& opt = {});
 
 } // namespace parserlib
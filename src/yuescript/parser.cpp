@@ -9,15 +9,29 @@ Redistributions in binary form must reproduce the above copyright notice, this l
 
 THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
 
+#include <algorithm>
+#include <bitset>
 #include <cassert>
+#include <chrono>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <unordered_map>
 #include <unordered_set>
 
 #include "yuescript/parser.hpp"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define _PARSERLIB_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif // _MSC_VER
+#endif // __SSE2__
+
 namespace parserlib {
 
 // internal private class that manages access to the public classes' internals.
@@ -38,21 +52,180 @@ public:
 		return r.m_expr;
 	}
 
+	// replace the internal expression object of the rule.
+	static void set_expr(rule& r, _expr* e) {
+		r.m_expr = e;
+	}
+
 	// get the internal parse proc from the rule.
 	static parse_proc get_parse_proc(rule& r) {
 		return r.m_parse_proc;
 	}
+
+	// check if the results of the rule are memoized.
+	static bool get_memo(rule& r) {
+		return r.m_memo.load(std::memory_order_relaxed);
+	}
+
+	// check if the rule is a token.
+	static bool get_token(rule& r) {
+		return r.m_token;
+	}
+
+	// get the number of rule ids in use.
+	static size_t rule_count();
+
+	// get the compiled instructions of the rule,
+	// with every rule called when profiling.
+	static const _program& get_program(rule& r, bool profiling);
+
+	// recursion of a rule
+	enum _RECURSION : char {
+		_UNKNOWN,
+		_NOT_RECURSIVE,
+		_RECURSIVE
+	};
+
+	// check if the rule can reach itself.
+	static _RECURSION get_recursive(rule& r) {
+		return static_cast<_RECURSION>(r.m_recursive.load(std::memory_order_relaxed));
+	}
+
+	// set the recursion of the rule once, a marked rule is never changed.
+	static void set_recursive(rule& r, _RECURSION recursion) {
+		char unknown = _UNKNOWN;
+		r.m_recursive.compare_exchange_strong(unknown, recursion, std::memory_order_relaxed);
+	}
 };
 
 class _context;
 
+// byte offset into the input, the line and the column of a position
+// are only computed for the parse procs, the user handlers and the errors
+typedef uint32_t _offset;
+
+// start offsets of the lines of an input, from the line a parse starts
+// at up to the furthest offset located, so a parse of a part of a large
+// input only scans the part
+class _line_index {
+public:
+	// constructor, the lines start after each '\n'; the line of the start
+	// offset is counted from the input begin when not given
+	_line_index(const char* data, size_t size, _offset start, int start_line)
+		: m_data(data)
+		, m_size(static_cast<_offset>(size)) {
+		_offset begin = start;
+		while (begin > 0 && data[begin - 1] != '\n') --begin;
+		if (start_line <= 0) {
+			start_line = 1;
+			for (const char* it = data; (it = static_cast<const char*>(std::memchr(it, '\n', data + begin - it))); ++it) {
+				++start_line;
+			}
+		}
+		m_first_line = start_line;
+		m_starts.push_back(begin);
+		m_scanned = begin;
+		for (_located& located : m_located) {
+			located.m_off = begin;
+		}
+	}
+
+	// get the line and the column of an offset, the column is counted
+	// from a recently located offset when it is further on the same line
+	void locate(_offset off, int& line, int& col) {
+		assert(off >= m_starts.front());
+		_scan(off);
+		// the begins and the ends of the matches are located in turns,
+		// so a few of the last located offsets are kept
+		_located* last = nullptr;
+		size_t index = _NO_LINE;
+		for (_located& located : m_located) {
+			if (!on_line(located.m_index, off)) continue;
+			index = located.m_index;
+			if (located.m_off <= off && (!last || located.m_off > last->m_off)) {
+				last = &located;
+			}
+		}
+		_located& next = m_located[m_next];
+		m_next = (m_next + 1) % _LOCATED;
+		if (last) {
+			next = *last;
+		} else {
+			if (index == _NO_LINE) {
+				index = std::upper_bound(m_starts.begin(), m_starts.end(), off) - m_starts.begin() - 1;
+			}
+			next.m_index = index;
+			next.m_off = m_starts[index];
+			next.m_col = 1;
+		}
+		// continuation bytes of a code point take no column
+		int count = next.m_col;
+		for (_offset from = next.m_off; from < off; ++from) {
+			if ((static_cast<unsigned char>(m_data[from]) & 0xC0) != 0x80) {
+				++count;
+			}
+		}
+		next.m_off = off;
+		next.m_col = count;
+		line = m_first_line + static_cast<int>(next.m_index);
+		col = count;
+	}
+
+private:
+	// check if the offset is on the line
+	bool on_line(size_t index, _offset off) const {
+		return off >= m_starts[index] && (index + 1 == m_starts.size() || off < m_starts[index + 1]);
+	}
+
+	// find the lines starting up to the offset, a few pages at a time
+	void _scan(_offset off) {
+		if (off < m_scanned) return;
+		size_t to = std::min<size_t>(m_size, std::max<size_t>(off + size_t{1}, m_scanned + size_t{_SCAN_SIZE}));
+		const char* end = m_data + to;
+		for (const char* it = m_data + m_scanned; (it = static_cast<const char*>(std::memchr(it, '\n', end - it)));) {
+			++it;
+			m_starts.push_back(static_cast<_offset>(it - m_data));
+		}
+		m_scanned = static_cast<_offset>(to);
+	}
+
+	const char* m_data;
+	_offset m_size;
+	std::vector<_offset> m_starts;
+
+	// line of the first start
+	int m_first_line;
+
+	// end of the bytes scanned for lines
+	_offset m_scanned;
+
+	// bytes scanned for lines at least at a time
+	static constexpr _offset _SCAN_SIZE = 16 * 1024;
+
+	// located offset
+	struct _located {
+		size_t m_index = 0;
+		_offset m_off = 0;
+		int m_col = 1;
+	};
+
+	// last located offsets, the next one replaces the oldest
+	static constexpr int _LOCATED = 4;
+	static constexpr size_t _NO_LINE = SIZE_MAX;
+	_located m_located[_LOCATED];
+	int m_next = 0;
+};
+
 // parser state
 class _state {
 public:
 	// position
-	pos m_pos;
+	_offset m_pos;
+
+	// size of the result stack
+	size_t m_results;
 
-	// size of match vector
+	// size of the match log
 	size_t m_matches;
 
 	// constructor
@@ -62,20 +235,20 @@ public:
 // match
 class _match {
 public:
-	// rule matched
-	rule* m_rule;
+	// id of the rule matched
+	uint32_t m_rule;
 
 	// begin position
-	pos m_begin;
+	_offset m_begin;
 
 	// end position
-	pos m_end;
+	_offset m_end;
 
 	// null constructor
 	_match() { }
 
 	// constructor from parameters
-	_match(rule* r, const pos& b, const pos& e)
+	_match(uint32_t r, _offset b, _offset e)
 		: m_rule(r)
 		, m_begin(b)
 		, m_end(e) {
@@ -85,6 +258,322 @@ public:
 // match vector
 typedef std::vector<_match> _match_vector;
 
+// memoized result of a rule at an input position
+struct _memo {
+	// parsing result
+	bool m_ok;
+
+	// position after the rule
+	_offset m_end;
+
+	// furthest error position reached by the rule
+	_offset m_error_pos;
+
+	// matches recorded by the rule
+	_match_vector m_matches;
+};
+
+// key of the memo table
+struct _memo_key {
+	rule* m_rule;
+	size_t m_pos;
+
+	bool operator==(const _memo_key& other) const {
+		return m_rule == other.m_rule && m_pos == other.m_pos;
+	}
+};
+
+struct _memo_key_hash {
+	size_t operator()(const _memo_key& key) const {
+		return std::hash<rule*>{}(key.m_rule) ^ (key.m_pos * 0x9E3779B97F4A7C15ull);
+	}
+};
+
+// memo table
+typedef std::unordered_map<_memo_key, _memo, _memo_key_hash> _memo_table;
+
+// token parsed at an input position
+struct _token {
+	// rule of the token
+	rule* m_rule;
+
+	// position after the token
+	_offset m_end;
+
+	// furthest error position reached by the token
+	_offset m_error_pos;
+
+	// kept results of the token
+	uint32_t m_results;
+	uint32_t m_count;
+
+	// next token at the same position, plus one
+	uint32_t m_next;
+};
+
+// opcodes of the compiled rules
+enum class OPCODE : unsigned char {
+	// match the character in the argument
+	CHAR,
+	// match an expression from the program tables
+	STRING,
+	SET,
+	LARGER,
+	SCAN,
+	// match any code point
+	ANY,
+	// match the end of input
+	END_OF_INPUT,
+	// fail
+	FAIL,
+	// parse a rule from the rule table
+	CALL,
+	// skip an alternative which can not start with the current byte
+	TEST,
+	// push a backtrack entry resuming at the argument
+	CHOICE,
+	// pop the backtrack entry and jump to the argument
+	COMMIT,
+	// update the backtrack entry to the current state and jump to the argument
+	PARTIAL_COMMIT,
+	// pop the backtrack entry, restore its state and jump to the argument
+	BACK_COMMIT,
+	// pop the backtrack entry, restore its state and fail
+	FAIL_TWICE,
+	// mark the backtrack entries of the rule, failing to any of them fails the rule
+	CUT,
+	// push the begin position of a user expression
+	USER_BEGIN,
+	// pop the begin position and call the handler from the handler table
+	USER_END,
+	// the rule is parsed
+	RETURN
+};
+
+// instruction
+struct _instr {
+	OPCODE m_op;
+	uint32_t m_arg;
+};
+
+// backtrack entry of a running rule
+struct _backtrack {
+	// state to restore
+	_offset m_pos;
+
+	// address to resume at, or USER for the begin of a user expression;
+	// the CUT bit is set when the entry is dropped by a commit
+	uint32_t m_resume;
+	static constexpr uint32_t USER = UINT32_MAX;
+	static constexpr uint32_t CUT = 0x80000000;
+
+	// sizes of the result stack and of the match log,
+	// kept in 32 bits like the offsets
+	uint32_t m_results;
+	uint32_t m_matches;
+};
+
+// first bytes of the input an expression can start with
+struct _first {
+	// bytes
+	std::bitset<256> m_bytes;
+
+	// the expression can succeed without consuming input,
+	// or has to be tried whatever the input is
+	bool m_empty = false;
+
+	// the first bytes of an expression which is always tried
+	static _first all() {
+		_first first;
+		first.m_bytes.set();
+		first.m_empty = true;
+		return first;
+	}
+};
+
+// first bytes of the rules, indexed by rule
+typedef std::unordered_map<rule*, _first> _first_cache;
+
+// test of the current byte before an alternative
+struct _test {
+	// bytes the alternative can start with
+	std::bitset<256> m_bytes;
+
+	// address of the next alternative, or FAIL for the last one
+	uint32_t m_next;
+	static constexpr uint32_t FAIL = UINT32_MAX;
+};
+
+class _string;
+class _set;
+class _larger;
+class _scan;
+
+// instructions of a rule, the grammar is run as a flat
+// array instead of walking the expression objects
+class _program {
+public:
+	// instructions
+	std::vector<_instr> m_code;
+
+	// operands of the instructions
+	std::vector<const _string*> m_strings;
+	std::vector<const _set*> m_sets;
+	std::vector<const _larger*> m_largers;
+	std::vector<const _scan*> m_scans;
+	std::vector<rule*> m_rules;
+	std::vector<const user_handler*> m_handlers;
+	std::vector<_test> m_tests;
+
+	// first bytes of the rules, only kept while compiling
+	_first_cache m_firsts;
+
+	// compile the expression of a rule
+	_program(const _expr* e, bool inline_rules);
+
+	// inline the rules which need no state of their own
+	bool m_inline_rules;
+
+	// max number of backtrack entries used by the instructions
+	uint32_t m_depth = 0;
+
+	// emit an instruction and return its address
+	uint32_t emit(OPCODE op, uint32_t arg = 0) {
+		switch (op) {
+			case OPCODE::CHOICE:
+			case OPCODE::USER_BEGIN:
+				if (++m_level > m_depth) m_depth = m_level;
+				break;
+			case OPCODE::COMMIT:
+			case OPCODE::PARTIAL_COMMIT:
+			case OPCODE::BACK_COMMIT:
+			case OPCODE::FAIL_TWICE:
+			case OPCODE::USER_END:
+				--m_level;
+				break;
+			default:
+				break;
+		}
+		assert(m_code.size() < _backtrack::CUT);
+		m_code.push_back({op, arg});
+		return static_cast<uint32_t>(m_code.size() - 1);
+	}
+
+	// address of the next instruction
+	uint32_t here() const {
+		return static_cast<uint32_t>(m_code.size());
+	}
+
+	// set the jump target of an instruction
+	void patch(uint32_t addr, uint32_t target) {
+		m_code[addr].m_arg = target;
+	}
+
+	// number of backtrack entries at the end of the emitted instructions
+	uint32_t m_level = 0;
+
+	// add an operand to a table and return its index
+	template <class T>
+	uint32_t add(std::vector<T>& table, T item) {
+		table.push_back(item);
+		return static_cast<uint32_t>(table.size() - 1);
+	}
+};
+
+// counters of the rules in a profiled parse
+class _profiler {
+public:
+	typedef std::chrono::steady_clock _clock;
+
+	// constructor
+	_profiler(size_t rule_count)
+		: m_rules(rule_count) { }
+
+	// start parsing a rule
+	void enter(size_t id, rule* r) {
+		_counters& counters = m_rules[id];
+		counters.m_rule = r;
+		++counters.m_active;
+		m_frames.push_back({id, _clock::duration::zero(), _clock::now()});
+	}
+
+	// end parsing the rule last entered
+	void leave(bool ok, size_t consumed) {
+		_frame frame = m_frames.back();
+		m_frames.pop_back();
+		_clock::duration time = _clock::now() - frame.m_start;
+		_counters& counters = m_rules[frame.m_id];
+		++counters.m_profile.calls;
+		if (ok) {
+			++counters.m_profile.successes;
+			counters.m_profile.consumed += consumed;
+		} else {
+			++counters.m_profile.failures;
+		}
+		counters.m_exclusive += time - frame.m_children;
+		// the time of a recursive call is already counted by the outer one
+		if (--counters.m_active == 0) {
+			counters.m_inclusive += time;
+		}
+		if (!m_frames.empty()) {
+			m_frames.back().m_children += time;
+		}
+	}
+
+	// count the bytes given back by the rule being parsed
+	void backtrack(size_t bytes) {
+		assert(!m_frames.empty());
+		m_rules[m_frames.back().m_id].m_profile.backtracked += bytes;
+	}
+
+	// count a memo table lookup of the rule being parsed
+	void memo(bool hit) {
+		assert(!m_frames.empty());
+		rule_profile& profile = m_rules[m_frames.back().m_id].m_profile;
+		++(hit ? profile.memo_hits : profile.memo_misses);
+	}
+
+	// get the counters of the rules parsed
+	void report(parse_profile& profile) const {
+		profile.clear();
+		for (const _counters& counters : m_rules) {
+			if (counters.m_profile.calls == 0) continue;
+			rule_profile item = counters.m_profile;
+			item.name = counters.m_rule->get_name();
+			item.inclusive_time = std::chrono::duration<double>(counters.m_inclusive).count();
+			item.exclusive_time = std::chrono::duration<double>(counters.m_exclusive).count();
+			profile.push_back(item);
+		}
+	}
+
+private:
+	// counters of a rule
+	struct _counters {
+		rule* m_rule = nullptr;
+		rule_profile m_profile;
+		_clock::duration m_inclusive = _clock::duration::zero();
+		_clock::duration m_exclusive = _clock::duration::zero();
+		// number of the calls running
+		int m_active = 0;
+	};
+
+	// running call of a rule
+	struct _frame {
+		size_t m_id;
+		_clock::duration m_children;
+		_clock::time_point m_start;
+	};
+
+	// counters indexed by rule id
+	std::vector<_counters> m_rules;
+
+	// calls being parsed
+	std::vector<_frame> m_frames;
+};
+
+// thrown to stop a parse whose work budget is spent
+struct _budget_exceeded { };
+
 // parsing context
 class _context {
 public:
@@ -92,88 +581,269 @@ public:
 	void* m_user_data;
 
 	// current position
-	pos m_pos;
+	_offset m_pos = 0;
 
 	// error position
-	pos m_error_pos;
+	_offset m_error_pos = 0;
 
 	// input begin
 	input::iterator m_begin;
 
-	// input end
-	input::iterator m_end;
+	// input bytes
+	const char* m_data;
+
+	// input size
+	_offset m_size;
+
+	// lines of the input
+	_line_index m_lines;
 
-	// matches
+	// stack of the results of the parse procedures
+	parse_stack* m_stack;
+
+	// size of the result stack
+	size_t m_results = 0;
+
+	// matches logged for the memo table and for the left recursions,
+	// whose parse procedures run once the recursion is resolved
 	_match_vector m_matches;
 
+	// number of memoized rules being parsed
+	int m_memo_depth = 0;
+
+	// size of the match log when the left recursion being resolved began
+	size_t m_lr_matches = 0;
+
+	// memoized rule results
+	_memo_table m_memo;
+
+	// memoize all the pure rules
+	bool m_memo_all;
+
+	// memoization counters
+	memo_stats m_memo_stats;
+
+	// reuse the parsed tokens
+	bool m_use_tokens;
+
+	// first token at each input position a token was parsed at, plus one
+	std::unordered_map<_offset, uint32_t> m_token_index;
+
+	// parsed tokens
+	std::vector<_token> m_tokens;
+
+	// results kept by the parsed tokens
+	std::vector<void*> m_token_results;
+
+	// number of user handlers run
+	size_t m_user_calls = 0;
+
+	// work left to the parse
+	size_t m_budget;
+
+	// number of left recursions being resolved
+	int m_lr_depth = 0;
+
+	// rule whose left recursion was resolved, the parse returns
+	// up to the invocation of the rule which started the recursion
+	rule* m_lr_exit = nullptr;
+
+	// parse states of the rules, indexed by rule id
+	std::vector<rule::_state> m_states;
+
+	// rules with a match recorded, indexed by rule id
+	std::vector<rule*> m_rules;
+
+	// counters of the rules, only for profiled parses
+	std::unique_ptr<_profiler> m_profiler;
+
+	// purity of the rules, indexed by rule id
+	std::vector<char> m_purity;
+
+	// backtrack entries of the running rules
+	std::vector<_backtrack> m_backtracks;
+
+	// number of backtrack entries taken by the running rules
+	size_t m_backtrack_top = 0;
+
 	// constructor
-	_context(input& i, void* ud)
+	_context(input& i, parse_stack* st, void* ud, const parse_options& opt)
 		: m_user_data(ud)
-		, m_pos(i)
-		, m_error_pos(i)
+		, m_pos(static_cast<_offset>(opt.start))
+		, m_error_pos(m_pos)
 		, m_begin(i.begin())
-		, m_end(i.end()) {
+		, m_data(i.data())
+		, m_size(static_cast<_offset>(i.size()))
+		, m_lines(i.data(), i.size(), static_cast<_offset>(opt.start), opt.start_line)
+		, m_stack(st)
+		, m_memo_all(opt.memo_all)
+		, m_use_tokens(opt.tokens && st && !opt.profile)
+		, m_budget(opt.budget ? opt.budget : SIZE_MAX)
+		, m_states(_private::rule_count())
+		, m_rules(m_states.size())
+		, m_profiler(opt.profile ? new _profiler(m_states.size()) : nullptr) {
+		assert(i.size() < _MAX_INPUT);
+	}
+
+	// inputs are indexed by 32 bits offsets
+	static constexpr size_t _MAX_INPUT = UINT32_MAX;
+
+	// get the parse state of a rule
+	rule::_state& state_of(rule& r) {
+		assert(r.m_id < m_states.size());
+		return m_states[r.m_id];
+	}
+
+	// check if a resolved left recursion is returning
+	bool lr_exiting() const {
+		return m_lr_exit != nullptr;
 	}
 
 	// check if the end is reached
 	bool end() const {
-		return m_pos.m_it == m_end;
+		return m_pos == m_size;
 	}
 
-	// get the current symbol
-	input::value_type symbol() const {
+	// get the current byte
+	unsigned char symbol() const {
 		assert(!end());
-		return *m_pos.m_it;
+		return static_cast<unsigned char>(m_data[m_pos]);
 	}
 
 	// set the longest possible error
 	void set_error_pos() {
-		if (m_pos.m_it > m_error_pos.m_it) {
+		if (m_pos > m_error_pos) {
 			m_error_pos = m_pos;
 		}
 	}
 
-	// next column
+	// next byte
 	void next_col() {
-		++m_pos.m_it;
-		++m_pos.m_col;
+		++m_pos;
 	}
 
-	// next line
-	void next_line() {
-		++m_pos.m_line;
-		m_pos.m_col = 1;
+	// next code point of the given byte length
+	void next_col(size_t len) {
+		m_pos += static_cast<_offset>(len);
+	}
+
+	// get the current code point and its byte length
+	char32_t code_point(size_t& len) const {
+		assert(!end());
+		const char* it = m_data + m_pos;
+		char32_t ch = utf8_next(it, m_data + m_size);
+		len = it - (m_data + m_pos);
+		return ch;
+	}
+
+	// get the full position of an offset
+	pos make_pos(_offset off) {
+		pos p;
+		p.m_it = m_begin + off;
+		m_lines.locate(off, p.m_line, p.m_col);
+		return p;
+	}
+
+	// drop the results above the given size
+	void restore_results(size_t results) {
+		if (m_results > results) {
+			m_stack->truncate(results);
+			m_results = results;
+		}
 	}
 
 	// restore the state
 	void restore(const _state& st) {
 		m_pos = st.m_pos;
+		restore_results(st.m_results);
 		m_matches.resize(st.m_matches);
 	}
 
+	// spend work of the budget, the parse stops once it is spent
+	void spend(size_t work) {
+		if (work > m_budget) {
+			throw _budget_exceeded();
+		}
+		m_budget -= work;
+	}
+
+	// restore the state of a backtrack entry
+	void restore(const _backtrack& bt) {
+		spend(m_pos - bt.m_pos);
+		if (m_profiler) {
+			m_profiler->backtrack(m_pos - bt.m_pos);
+		}
+		m_pos = bt.m_pos;
+		restore_results(bt.m_results);
+		m_matches.resize(bt.m_matches);
+	}
+
 	// parse non-term rule.
 	bool parse_non_term(rule& r);
 
-	// parse term rule.
-	bool parse_term(rule& r);
+	// execute the parse procs of the logged matches from the given one
+	void do_parse_procs(size_t from) {
+		for (size_t i = from; i < m_matches.size(); ++i) {
+			const _match& m = m_matches[i];
+			do_parse_proc(*m_rules[m.m_rule], m.m_begin, m.m_end);
+		}
+	}
 
-	// execute all the parse procs
-	void do_parse_procs(void* d) const {
-		for (_match_vector::const_iterator it = m_matches.begin();
-			it != m_matches.end();
-			++it) {
-			const _match& m = *it;
-			parse_proc p = _private::get_parse_proc(*m.m_rule);
-			p(m.m_begin, m.m_end, d);
+	// execute the parse proc of a match
+	void do_parse_proc(rule& r, _offset b, _offset e) {
+		parse_proc p = _private::get_parse_proc(r);
+		p(make_pos(b), make_pos(e), m_stack);
+		if (m_stack) {
+			m_results = m_stack->size();
 		}
 	}
 
 private:
+	// parse non-term rule, resolving its left recursion.
+	bool _parse_rule(rule& r);
+
 	// parse non-term rule.
 	bool _parse_non_term(rule& r);
 
-	// parse term rule.
-	bool _parse_term(rule& r);
+	// run the instructions of a rule.
+	bool _run(const _program& prog);
+
+	// purity of a rule
+	enum _PURITY : char {
+		_UNKNOWN,
+		_PURE,
+		_IMPURE
+	};
+
+	// check if the rule reaches no user handler.
+	bool _is_pure(rule& r);
+
+	// check if the result of the rule should be memoized.
+	bool _use_memo(rule& r) {
+		return m_lr_depth == 0 && (_private::get_memo(r) || (m_memo_all && _is_pure(r)));
+	}
+
+	// parse rule with the memo table.
+	bool _parse_memo(rule& r);
+
+	// check if the parsed token should be reused.
+	bool _use_token(rule& r) const {
+		return r.m_token && m_use_tokens && m_lr_depth == 0 && m_memo_depth == 0;
+	}
+
+	// parse rule with the token table.
+	bool _parse_token(rule& r);
+
+	// end the left recursion returning to the rule which started it,
+	// the outermost one runs the parse procs of the logged matches
+	void _lr_resolved() {
+		m_lr_exit = nullptr;
+		if (m_lr_depth > 0) return;
+		do_parse_procs(m_lr_matches);
+		if (m_memo_depth == 0) {
+			m_matches.resize(m_lr_matches);
+		}
+	}
 };
 
 enum class EXPR_TYPE {
@@ -181,7 +851,13 @@ enum class EXPR_TYPE {
 	SEQ_TWO,
 	SEQ_LIST,
 	CHOICE_TWO,
-	CHOICE_LIST
+	CHOICE_LIST,
+	REF,
+	USER,
+	CHAR,
+	STRING,
+	SET,
+	LARGER
 };
 
 // base class for expressions
@@ -191,13 +867,19 @@ public:
 	virtual ~_expr() {
 	}
 
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const = 0;
+	// emit the instructions of the expression
+	virtual void compile(_program& prog) const = 0;
 
-	// parse terminal
-	virtual bool parse_term(_context& con) const = 0;
+	// get the first bytes of the expression, any byte unless overridden
+	virtual _first first(_first_cache&) const { return _first::all(); }
 
 	virtual EXPR_TYPE get_type() const { return EXPR_TYPE::NORMAL; }
+
+	// visit the sub expressions
+	virtual void visit_children(const std::function<void(_expr*)>&) const { }
+
+	// replace the sub expressions with the ones returned by the function
+	virtual void rewrite_children(const std::function<_expr*(_expr*)>&) { }
 };
 
 // single character expression.
@@ -208,32 +890,28 @@ public:
 		: m_char(c) {
 	}
 
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const override {
-		return _parse(con);
+	virtual void compile(_program& prog) const override {
+		prog.emit(OPCODE::CHAR, m_char);
 	}
 
-	// parse terminal
-	virtual bool parse_term(_context& con) const override {
-		return _parse(con);
+	virtual _first first(_first_cache&) const override {
+		_first first;
+		first.m_bytes.set(m_char);
+		return first;
 	}
 
-private:
-	// character
-	input::value_type m_char;
+	virtual EXPR_TYPE get_type() const override {
+		return EXPR_TYPE::CHAR;
+	}
 
-	// internal parse
-	bool _parse(_context& con) const {
-		if (!con.end()) {
-			input::value_type ch = con.symbol();
-			if (ch == m_char) {
-				con.next_col();
-				return true;
-			}
-		}
-		con.set_error_pos();
-		return false;
+	// get the character
+	unsigned char get_char() const {
+		return m_char;
 	}
+
+private:
+	// character
+	unsigned char m_char;
 };
 
 // string expression.
@@ -241,37 +919,55 @@ class _string : public _expr {
 public:
 	// constructor from ansi string.
 	_string(const char* s)
-		: m_string(Converter{}.from_bytes(s)) {
+		: m_string(s) {
 	}
 
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const override {
-		return _parse(con);
+	// constructor from string.
+	_string(input s)
+		: m_string(std::move(s)) {
 	}
 
-	// parse terminal
-	virtual bool parse_term(_context& con) const override {
-		return _parse(con);
+	virtual void compile(_program& prog) const override {
+		prog.emit(OPCODE::STRING, prog.add(prog.m_strings, this));
 	}
 
-private:
-	// string
-	input m_string;
+	virtual _first first(_first_cache&) const override {
+		_first first;
+		if (m_string.empty()) {
+			first.m_empty = true;
+		} else {
+			first.m_bytes.set(static_cast<unsigned char>(m_string.front()));
+		}
+		return first;
+	}
 
 	// parse the string
-	bool _parse(_context& con) const {
+	bool match(_context& con) const {
 		for (auto it = m_string.begin(),
 				  end = m_string.end();
 			;) {
 			if (it == end) return true;
 			if (con.end()) break;
-			if (con.symbol() != *it) break;
+			if (con.symbol() != static_cast<unsigned char>(*it)) break;
 			++it;
 			con.next_col();
 		}
 		con.set_error_pos();
 		return false;
 	}
+
+	virtual EXPR_TYPE get_type() const override {
+		return EXPR_TYPE::STRING;
+	}
+
+	// get the string
+	const input& get_string() const {
+		return m_string;
+	}
+
+private:
+	// string
+	input m_string;
 };
 
 // set expression.
@@ -279,66 +975,114 @@ class _set : public _expr {
 public:
 	// constructor from ansi string.
 	_set(const char* s) {
-		auto str = Converter{}.from_bytes(s);
-		for (auto ch : str) {
-			_add(ch);
+		for (const char *it = s, *end = s + std::strlen(s); it != end;) {
+			size_t ch = utf8_next(it, end);
+			_add(ch, ch);
 		}
 	}
 
 	// constructor from range.
-	_set(int min, int max) {
-		assert(min >= 0);
+	_set(size_t min, size_t max) {
 		assert(min <= max);
-		m_quick_set.resize((size_t)max + 1U);
-		for (; min <= max; ++min) {
-			m_quick_set[(size_t)min] = true;
-		}
-	}
-
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const override {
-		return _parse(con);
+		_add(min, max);
 	}
 
-	// parse terminal
-	virtual bool parse_term(_context& con) const override {
-		return _parse(con);
+	virtual void compile(_program& prog) const override {
+		prog.emit(OPCODE::SET, prog.add(prog.m_sets, this));
 	}
 
-private:
-	// set is kept as an array of flags, for quick access
-	std::vector<bool> m_quick_set;
-	std::unordered_set<size_t> m_large_set;
-
-	// add character
-	void _add(size_t i) {
-		if (i <= m_quick_set.size() || i <= 255) {
-			if (i >= m_quick_set.size()) {
-				m_quick_set.resize(i + 1);
+	// a code point above ASCII may start with any byte above ASCII
+	virtual _first first(_first_cache&) const override {
+		_first first;
+		bool high = !m_ranges.empty();
+		for (size_t i = 0; i < 0x100; ++i) {
+			if (!m_bits[i]) continue;
+			if (i < 0x80) {
+				first.m_bytes.set(i);
+			} else {
+				high = true;
 			}
-			m_quick_set[i] = true;
-		} else {
-			m_large_set.insert(i);
 		}
+		if (high) {
+			for (size_t i = 0x80; i < 0x100; ++i) {
+				first.m_bytes.set(i);
+			}
+		}
+		return first;
+	}
+
+	virtual EXPR_TYPE get_type() const override {
+		return EXPR_TYPE::SET;
 	}
 
-	// internal parse
-	bool _parse(_context& con) const {
+	// parse a character of the set
+	bool match(_context& con) const {
 		if (!con.end()) {
 			size_t ch = con.symbol();
-			if (ch < m_quick_set.size()) {
-				if (m_quick_set[ch]) {
+			if (ch < 0x80) {
+				if (m_bits[ch]) {
 					con.next_col();
 					return true;
 				}
-			} else if (m_large_set.find(ch) != m_large_set.end()) {
-				con.next_col();
-				return true;
+			} else {
+				size_t len = 1;
+				ch = con.code_point(len);
+				if (ch < 0x100 ? m_bits[ch] : _in_ranges(ch)) {
+					con.next_col(len);
+					return true;
+				}
 			}
 		}
 		con.set_error_pos();
 		return false;
 	}
+
+	// add the members of another set
+	void merge(const _set& other) {
+		m_bits |= other.m_bits;
+		for (const auto& range : other.m_ranges) {
+			_add(range.first, range.second);
+		}
+	}
+
+private:
+	// members below 256, one bit each
+	std::bitset<0x100> m_bits;
+
+	// members from 256, as sorted and disjoint ranges
+	std::vector<std::pair<size_t, size_t>> m_ranges;
+
+	// check if a code point from 256 is a member
+	bool _in_ranges(size_t ch) const {
+		auto it = std::upper_bound(m_ranges.begin(), m_ranges.end(), ch,
+			[](size_t c, const std::pair<size_t, size_t>& range) {
+				return c < range.first;
+			});
+		return it != m_ranges.begin() && ch <= (--it)->second;
+	}
+
+	// largest code point kept, the decoded code points are far below
+	static constexpr size_t _MAX_CODE = 0x7FFFFFFF;
+
+	// add a range of code points
+	void _add(size_t min, size_t max) {
+		max = std::min(max, _MAX_CODE);
+		for (; min <= max && min < 0x100; ++min) {
+			m_bits.set(min);
+		}
+		if (min > max) return;
+		// join the ranges which overlap or touch the new one
+		auto it = m_ranges.begin();
+		while (it != m_ranges.end() && it->second + 1 < min) ++it;
+		auto last = it;
+		while (last != m_ranges.end() && last->first <= max + 1) {
+			min = std::min(min, last->first);
+			max = std::max(max, last->second);
+			++last;
+		}
+		it = m_ranges.erase(it, last);
+		m_ranges.insert(it, {min, max});
+	}
 };
 
 // right interval expression.
@@ -349,31 +1093,160 @@ public:
 		: m_value(value) {
 	}
 
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const override {
-		return _parse(con);
+	virtual void compile(_program& prog) const override {
+		prog.emit(OPCODE::LARGER, prog.add(prog.m_largers, this));
 	}
 
-	// parse terminal
-	virtual bool parse_term(_context& con) const override {
-		return _parse(con);
+	virtual _first first(_first_cache&) const override {
+		_first first;
+		for (size_t i = 0; i < 0x100; ++i) {
+			if (i >= 0x80 || i > m_value) {
+				first.m_bytes.set(i);
+			}
+		}
+		return first;
 	}
 
-private:
-	size_t m_value;
+	virtual EXPR_TYPE get_type() const override {
+		return EXPR_TYPE::LARGER;
+	}
+
+	// get the value the code points are larger than
+	size_t get_value() const {
+		return m_value;
+	}
 
-	// internal parse
-	bool _parse(_context& con) const {
+	// parse a code point larger than the value
+	bool match(_context& con) const {
 		if (!con.end()) {
+			size_t len = 1;
 			size_t ch = con.symbol();
+			if (ch >= 0x80) {
+				ch = con.code_point(len);
+			}
 			if (ch > m_value) {
-				con.next_col();
+				con.next_col(len);
 				return true;
 			}
 		}
 		con.set_error_pos();
 		return false;
 	}
+
+private:
+	size_t m_value;
+};
+
+// index of the lowest set bit
+static inline int _lowest_bit(unsigned int mask) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return static_cast<int>(index);
+#else // _MSC_VER
+	return __builtin_ctz(mask);
+#endif // _MSC_VER
+}
+
+// skip expression, the input is tested 16 bytes at a time with SSE2
+class _scan : public _expr {
+public:
+	// constructor from ansi string.
+	_scan(const char* s, bool until)
+		: m_until(until) {
+		for (const char* it = s; *it; ++it) {
+			auto ch = static_cast<unsigned char>(*it);
+			assert(ch < 0x80);
+			m_set.set(ch);
+			m_chars.push_back(*it);
+		}
+	}
+
+	virtual void compile(_program& prog) const override {
+		prog.emit(OPCODE::SCAN, prog.add(prog.m_scans, this));
+	}
+
+	virtual _first first(_first_cache&) const override {
+		_first first;
+		for (size_t i = 0; i < 0x100; ++i) {
+			if ((i < 0x80 && m_set[i]) != m_until) {
+				first.m_bytes.set(i);
+			}
+		}
+		first.m_empty = true;
+		return first;
+	}
+
+	// skip the input, the stop position is recorded like
+	// the failing character of a loop
+	void match(_context& con) const {
+		const char* begin = con.m_data + con.m_pos;
+		const char* end = con.m_data + con.m_size;
+		const char* it = m_until ? _skip_until(begin, end) : _skip_while(begin, end);
+		con.m_pos += static_cast<_offset>(it - begin);
+		con.set_error_pos();
+	}
+
+private:
+	// characters to stop at or to skip
+	std::bitset<0x80> m_set;
+	input m_chars;
+
+	// skip up to the characters instead of skipping them
+	bool m_until;
+
+	// max number of characters tested with SSE2
+	static const size_t _SIMD_CHARS = 4;
+
+#ifdef _PARSERLIB_SSE2
+	// get the mask of the bytes in a block which are one of the characters
+	unsigned int _match_mask(__m128i block) const {
+		__m128i found = _mm_setzero_si128();
+		for (char ch : m_chars) {
+			found = _mm_or_si128(found, _mm_cmpeq_epi8(block, _mm_set1_epi8(ch)));
+		}
+		return static_cast<unsigned int>(_mm_movemask_epi8(found));
+	}
+#endif // _PARSERLIB_SSE2
+
+	// skip up to the characters, the bytes of a code point
+	// are never ASCII, so they are skipped one by one
+	const char* _skip_until(const char* it, const char* end) const {
+#ifdef _PARSERLIB_SSE2
+		if (m_chars.size() <= _SIMD_CHARS) {
+			while (end - it >= 16) {
+				__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(it));
+				unsigned int mask = _match_mask(block);
+				if (mask) return it + _lowest_bit(mask);
+				it += 16;
+			}
+		}
+#endif // _PARSERLIB_SSE2
+		for (; it != end; ++it) {
+			auto ch = static_cast<unsigned char>(*it);
+			if (ch < 0x80 && m_set[ch]) break;
+		}
+		return it;
+	}
+
+	// skip a run of the characters
+	const char* _skip_while(const char* it, const char* end) const {
+#ifdef _PARSERLIB_SSE2
+		if (m_chars.size() <= _SIMD_CHARS) {
+			while (end - it >= 16) {
+				__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(it));
+				unsigned int mask = ~_match_mask(block) & 0xFFFF;
+				if (mask) return it + _lowest_bit(mask);
+				it += 16;
+			}
+		}
+#endif // _PARSERLIB_SSE2
+		for (; it != end; ++it) {
+			auto ch = static_cast<unsigned char>(*it);
+			if (ch >= 0x80 || !m_set[ch]) break;
+		}
+		return it;
+	}
 };
 
 // base class for unary expressions
@@ -389,6 +1262,14 @@ public:
 		delete m_expr;
 	}
 
+	virtual void visit_children(const std::function<void(_expr*)>& func) const override {
+		func(m_expr);
+	}
+
+	virtual void rewrite_children(const std::function<_expr*(_expr*)>& func) override {
+		m_expr = func(m_expr);
+	}
+
 protected:
 	// expression
 	_expr* m_expr;
@@ -402,14 +1283,12 @@ public:
 		: _unary(e) {
 	}
 
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const override {
-		return m_expr->parse_term(con);
+	virtual void compile(_program& prog) const override {
+		m_expr->compile(prog);
 	}
 
-	// parse terminal
-	virtual bool parse_term(_context& con) const override {
-		return m_expr->parse_term(con);
+	virtual _first first(_first_cache& cache) const override {
+		return m_expr->first(cache);
 	}
 };
 
@@ -422,30 +1301,30 @@ public:
 		, m_handler(callback) {
 	}
 
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const override {
-		pos pos = con.m_pos;
-		if (m_expr->parse_non_term(con)) {
-			item_t item = {&pos, &con.m_pos, con.m_user_data};
-			return m_handler(item);
-		}
-		return false;
+	// the handler is called with the range parsed by the expression
+	virtual void compile(_program& prog) const override {
+		prog.emit(OPCODE::USER_BEGIN);
+		m_expr->compile(prog);
+		prog.emit(OPCODE::USER_END, prog.add(prog.m_handlers, &m_handler));
 	}
 
-	// parse terminal
-	virtual bool parse_term(_context& con) const override {
-		pos pos = con.m_pos;
-		if (m_expr->parse_term(con)) {
-			item_t item = {&pos, &con.m_pos, con.m_user_data};
-			return m_handler(item);
-		}
-		return false;
+	virtual EXPR_TYPE get_type() const override {
+		return EXPR_TYPE::USER;
 	}
 
 private:
 	user_handler m_handler;
 };
 
+// emit a loop which parses the expression until it fails
+static void _compile_loop(_program& prog, const _expr* e) {
+	// if parsing fails, restore the last good state and stop
+	uint32_t choice = prog.emit(OPCODE::CHOICE);
+	e->compile(prog);
+	prog.emit(OPCODE::PARTIAL_COMMIT, choice + 1);
+	prog.patch(choice, prog.here());
+}
+
 // loop 0
 class _loop0 : public _unary {
 public:
@@ -454,46 +1333,14 @@ public:
 		: _unary(e) {
 	}
 
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const override {
-		// if parsing of the first fails, restore the context and stop
-		_state st(con);
-		if (!m_expr->parse_non_term(con)) {
-			con.restore(st);
-			return true;
-		}
-
-		// parse the rest
-		for (;;) {
-			_state st(con);
-			if (!m_expr->parse_non_term(con)) {
-				con.restore(st);
-				break;
-			}
-		}
-
-		return true;
+	virtual void compile(_program& prog) const override {
+		_compile_loop(prog, m_expr);
 	}
 
-	// parse terminal
-	virtual bool parse_term(_context& con) const override {
-		// if parsing of the first fails, restore the context and stop
-		_state st(con);
-		if (!m_expr->parse_term(con)) {
-			con.restore(st);
-			return true;
-		}
-
-		// parse the rest until no more parsing is possible
-		for (;;) {
-			_state st(con);
-			if (!m_expr->parse_term(con)) {
-				con.restore(st);
-				break;
-			}
-		}
-
-		return true;
+	virtual _first first(_first_cache& cache) const override {
+		_first first = m_expr->first(cache);
+		first.m_empty = true;
+		return first;
 	}
 };
 
@@ -505,38 +1352,14 @@ public:
 		: _unary(e) {
 	}
 
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const override {
-		// parse the first; if the first fails, stop
-		if (!m_expr->parse_non_term(con)) return false;
-
-		// parse the rest until no more parsing is possible
-		for (;;) {
-			_state st(con);
-			if (!m_expr->parse_non_term(con)) {
-				con.restore(st);
-				break;
-			}
-		}
-
-		return true;
+	// parse the first; if the first fails, stop
+	virtual void compile(_program& prog) const override {
+		m_expr->compile(prog);
+		_compile_loop(prog, m_expr);
 	}
 
-	// parse terminal
-	virtual bool parse_term(_context& con) const override {
-		// parse the first; if the first fails, stop
-		if (!m_expr->parse_term(con)) return false;
-
-		// parse the rest until no more parsing is possible
-		for (;;) {
-			_state st(con);
-			if (!m_expr->parse_term(con)) {
-				con.restore(st);
-				break;
-			}
-		}
-
-		return true;
+	virtual _first first(_first_cache& cache) const override {
+		return m_expr->first(cache);
 	}
 };
 
@@ -548,18 +1371,18 @@ public:
 		: _unary(e) {
 	}
 
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const override {
-		_state st(con);
-		if (!m_expr->parse_non_term(con)) con.restore(st);
-		return true;
+	virtual void compile(_program& prog) const override {
+		uint32_t choice = prog.emit(OPCODE::CHOICE);
+		m_expr->compile(prog);
+		uint32_t commit = prog.emit(OPCODE::COMMIT);
+		prog.patch(choice, prog.here());
+		prog.patch(commit, prog.here());
 	}
 
-	// parse terminal
-	virtual bool parse_term(_context& con) const override {
-		_state st(con);
-		if (!m_expr->parse_term(con)) con.restore(st);
-		return true;
+	virtual _first first(_first_cache& cache) const override {
+		_first first = m_expr->first(cache);
+		first.m_empty = true;
+		return first;
 	}
 };
 
@@ -571,20 +1394,19 @@ public:
 		: _unary(e) {
 	}
 
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const override {
-		_state st(con);
-		bool ok = m_expr->parse_non_term(con);
-		con.restore(st);
-		return ok;
+	virtual void compile(_program& prog) const override {
+		uint32_t choice = prog.emit(OPCODE::CHOICE);
+		m_expr->compile(prog);
+		uint32_t commit = prog.emit(OPCODE::BACK_COMMIT);
+		prog.patch(choice, prog.here());
+		prog.emit(OPCODE::FAIL);
+		prog.patch(commit, prog.here());
 	}
 
-	// parse terminal
-	virtual bool parse_term(_context& con) const override {
-		_state st(con);
-		bool ok = m_expr->parse_term(con);
-		con.restore(st);
-		return ok;
+	// the input has to start like the expression,
+	// whatever follows the predicate
+	virtual _first first(_first_cache& cache) const override {
+		return m_expr->first(cache);
 	}
 };
 
@@ -596,20 +1418,11 @@ public:
 		: _unary(e) {
 	}
 
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const override {
-		_state st(con);
-		bool ok = !m_expr->parse_non_term(con);
-		con.restore(st);
-		return ok;
-	}
-
-	// parse terminal
-	virtual bool parse_term(_context& con) const override {
-		_state st(con);
-		bool ok = !m_expr->parse_term(con);
-		con.restore(st);
-		return ok;
+	virtual void compile(_program& prog) const override {
+		uint32_t choice = prog.emit(OPCODE::CHOICE);
+		m_expr->compile(prog);
+		prog.emit(OPCODE::FAIL_TWICE);
+		prog.patch(choice, prog.here());
 	}
 };
 
@@ -621,18 +1434,13 @@ public:
 		: _unary(e) {
 	}
 
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const override {
-		if (!m_expr->parse_non_term(con)) return false;
-		con.next_line();
-		return true;
+	virtual void compile(_program& prog) const override {
+		// the lines are found from the input when a position is reported
+		m_expr->compile(prog);
 	}
 
-	// parse terminal
-	virtual bool parse_term(_context& con) const override {
-		if (!m_expr->parse_term(con)) return false;
-		con.next_line();
-		return true;
+	virtual _first first(_first_cache& cache) const override {
+		return m_expr->first(cache);
 	}
 };
 
@@ -651,6 +1459,16 @@ public:
 		if (m_right) delete m_right;
 	}
 
+	virtual void visit_children(const std::function<void(_expr*)>& func) const override {
+		func(m_left);
+		func(m_right);
+	}
+
+	virtual void rewrite_children(const std::function<_expr*(_expr*)>& func) override {
+		m_left = func(m_left);
+		m_right = func(m_right);
+	}
+
 protected:
 	// left and right expressions
 	_expr* m_left;
@@ -658,8 +1476,32 @@ protected:
 
 	friend expr operator>>(expr&& left, expr&& right);
 	friend expr operator|(expr&& left, expr&& right);
+	friend class _optimizer;
 };
 
+// get the first bytes of a sequence of expressions
+static _first _first_of_seq(const _expr* const* begin, const _expr* const* end, _first_cache& cache) {
+	_first first;
+	first.m_empty = true;
+	for (auto it = begin; it != end && first.m_empty; ++it) {
+		_first item = (*it)->first(cache);
+		first.m_bytes |= item.m_bytes;
+		first.m_empty = item.m_empty;
+	}
+	return first;
+}
+
+// get the first bytes of a choice of expressions
+static _first _first_of_choice(const _expr* const* begin, const _expr* const* end, _first_cache& cache) {
+	_first first;
+	for (auto it = begin; it != end; ++it) {
+		_first item = (*it)->first(cache);
+		first.m_bytes |= item.m_bytes;
+		first.m_empty = first.m_empty || item.m_empty;
+	}
+	return first;
+}
+
 // sequence
 class _seq : public _binary {
 public:
@@ -668,16 +1510,14 @@ public:
 		: _binary(left, right) {
 	}
 
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const override {
-		if (!m_left->parse_non_term(con)) return false;
-		return m_right->parse_non_term(con);
+	virtual void compile(_program& prog) const override {
+		m_left->compile(prog);
+		m_right->compile(prog);
 	}
 
-	// parse terminal
-	virtual bool parse_term(_context& con) const override {
-		if (!m_left->parse_term(con)) return false;
-		return m_right->parse_term(con);
+	virtual _first first(_first_cache& cache) const override {
+		const _expr* list[] = {m_left, m_right};
+		return _first_of_seq(list, list + 2, cache);
 	}
 
 	virtual EXPR_TYPE get_type() const override {
@@ -704,31 +1544,67 @@ public:
 		}
 	}
 
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const override {
+	virtual void compile(_program& prog) const override {
 		for (_expr* expr : m_list) {
-			if (!expr->parse_non_term(con)) return false;
+			expr->compile(prog);
 		}
-		return true;
 	}
 
-	// parse terminal
-	virtual bool parse_term(_context& con) const override {
-		for (_expr* expr : m_list) {
-			if (!expr->parse_term(con)) return false;
-		}
-		return true;
+	virtual _first first(_first_cache& cache) const override {
+		return _first_of_seq(m_list.data(), m_list.data() + m_list.size(), cache);
 	}
 
 	virtual EXPR_TYPE get_type() const override {
 		return EXPR_TYPE::SEQ_LIST;
 	}
 
+	virtual void visit_children(const std::function<void(_expr*)>& func) const override {
+		for (_expr* expr : m_list) {
+			func(expr);
+		}
+	}
+
+	virtual void rewrite_children(const std::function<_expr*(_expr*)>& func) override {
+		for (_expr*& expr : m_list) {
+			expr = func(expr);
+		}
+	}
+
 private:
 	std::vector<_expr*> m_list;
 	friend expr operator>>(expr&& left, expr&& right);
+	friend class _optimizer;
 };
 
+// emit a choice of the expressions, the last one is tried without a backtrack entry.
+// an alternative which can not start with the current byte is skipped, unless it
+// can succeed without consuming input or has to be tried anyway
+static void _compile_choice(_program& prog, const _expr* const* begin, const _expr* const* end) {
+	std::vector<uint32_t> commits;
+	for (auto it = begin; it != end; ++it) {
+		bool last = it + 1 == end;
+		_first first = (*it)->first(prog.m_firsts);
+		bool tested = !first.m_empty && !first.m_bytes.all();
+		uint32_t test = 0;
+		if (tested) {
+			test = prog.add(prog.m_tests, _test{first.m_bytes, _test::FAIL});
+			prog.emit(OPCODE::TEST, test);
+		}
+		if (last) {
+			(*it)->compile(prog);
+		} else {
+			uint32_t choice = prog.emit(OPCODE::CHOICE);
+			(*it)->compile(prog);
+			commits.push_back(prog.emit(OPCODE::COMMIT));
+			prog.patch(choice, prog.here());
+			if (tested) prog.m_tests[test].m_next = prog.here();
+		}
+	}
+	for (uint32_t commit : commits) {
+		prog.patch(commit, prog.here());
+	}
+}
+
 // choice
 class _choice : public _binary {
 public:
@@ -737,20 +1613,14 @@ public:
 		: _binary(left, right) {
 	}
 
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const override {
-		_state st(con);
-		if (m_left->parse_non_term(con)) return true;
-		con.restore(st);
-		return m_right->parse_non_term(con);
+	virtual void compile(_program& prog) const override {
+		const _expr* list[] = {m_left, m_right};
+		_compile_choice(prog, list, list + 2);
 	}
 
-	// parse terminal
-	virtual bool parse_term(_context& con) const override {
-		_state st(con);
-		if (m_left->parse_term(con)) return true;
-		con.restore(st);
-		return m_right->parse_term(con);
+	virtual _first first(_first_cache& cache) const override {
+		const _expr* list[] = {m_left, m_right};
+		return _first_of_choice(list, list + 2, cache);
 	}
 
 	virtual EXPR_TYPE get_type() const override {
@@ -777,33 +1647,34 @@ public:
 		}
 	}
 
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const override {
-		_state st(con);
-		for (_expr* expr : m_list) {
-			if (expr->parse_non_term(con)) return true;
-			if (expr != m_list.back()) con.restore(st);
-		}
-		return false;
+	virtual void compile(_program& prog) const override {
+		_compile_choice(prog, m_list.data(), m_list.data() + m_list.size());
 	}
 
-	// parse terminal
-	virtual bool parse_term(_context& con) const override {
-		_state st(con);
-		for (_expr* expr : m_list) {
-			if (expr->parse_term(con)) return true;
-			if (expr != m_list.back()) con.restore(st);
-		}
-		return false;
+	virtual _first first(_first_cache& cache) const override {
+		return _first_of_choice(m_list.data(), m_list.data() + m_list.size(), cache);
 	}
 
 	virtual EXPR_TYPE get_type() const override {
 		return EXPR_TYPE::CHOICE_LIST;
 	}
 
+	virtual void visit_children(const std::function<void(_expr*)>& func) const override {
+		for (_expr* expr : m_list) {
+			func(expr);
+		}
+	}
+
+	virtual void rewrite_children(const std::function<_expr*(_expr*)>& func) override {
+		for (_expr*& expr : m_list) {
+			expr = func(expr);
+		}
+	}
+
 private:
 	std::vector<_expr*> m_list;
 	friend expr operator|(expr&& left, expr&& right);
+	friend class _optimizer;
 };
 
 // reference to rule
@@ -814,14 +1685,27 @@ public:
 		: m_rule(r) {
 	}
 
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const override {
-		return con.parse_non_term(m_rule);
+	virtual void compile(_program& prog) const override;
+
+	// a rule reached again before its first bytes are known is left
+	// recursive, it is always tried since it may match without input
+	virtual _first first(_first_cache& cache) const override {
+		auto it = cache.find(m_rule.this_ptr());
+		if (it != cache.end()) return it->second;
+		cache[m_rule.this_ptr()] = _first::all();
+		_expr* body = _private::get_expr(m_rule);
+		_first first = body ? body->first(cache) : _first::all();
+		cache[m_rule.this_ptr()] = first;
+		return first;
 	}
 
-	// parse terminal
-	virtual bool parse_term(_context& con) const override {
-		return con.parse_term(m_rule);
+	virtual EXPR_TYPE get_type() const override {
+		return EXPR_TYPE::REF;
+	}
+
+	// get the referenced rule
+	rule& get_rule() const {
+		return m_rule;
 	}
 
 private:
@@ -832,203 +1716,588 @@ private:
 // eof
 class _eof : public _expr {
 public:
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const override {
-		return parse_term(con);
-	}
-
-	// parse terminal
-	virtual bool parse_term(_context& con) const override {
-		return con.end();
+	virtual void compile(_program& prog) const override {
+		prog.emit(OPCODE::END_OF_INPUT);
 	}
 };
 
 // any
 class _any : public _expr {
 public:
-	// parse with whitespace
-	virtual bool parse_non_term(_context& con) const override {
-		return parse_term(con);
+	virtual void compile(_program& prog) const override {
+		prog.emit(OPCODE::ANY);
 	}
 
-	// parse terminal
-	virtual bool parse_term(_context& con) const override {
-		if (!con.end()) {
-			con.next_col();
+	virtual _first first(_first_cache&) const override {
+		_first first;
+		first.m_bytes.set();
+		return first;
+	}
+};
+
+// true
+class _true : public _expr {
+public:
+	// parsing succeeds without any instruction
+	virtual void compile(_program&) const override { }
+
+	virtual _first first(_first_cache&) const override {
+		_first first;
+		first.m_empty = true;
+		return first;
+	}
+};
+
+// false
+class _false : public _expr {
+public:
+	virtual void compile(_program& prog) const override {
+		prog.emit(OPCODE::FAIL);
+	}
+};
+
+// commit
+class _commit : public _expr {
+public:
+	// the choices are dropped when the commit is reached
+	virtual void compile(_program& prog) const override {
+		prog.emit(OPCODE::CUT);
+	}
+
+	virtual _first first(_first_cache&) const override {
+		_first first;
+		first.m_empty = true;
+		return first;
+	}
+};
+
+// collect the rules referenced by the expression.
+static void _collect_refs(const _expr* e, std::vector<rule*>& refs) {
+	if (e->get_type() == EXPR_TYPE::REF) {
+		refs.push_back(static_cast<const _ref*>(e)->get_rule().this_ptr());
+		return;
+	}
+	e->visit_children([&](_expr* child) {
+		_collect_refs(child, refs);
+	});
+}
+
+// finds the rules which can reach themselves, the rules reachable from
+// a rule are split into strongly connected components
+class _recursion_finder {
+public:
+	// mark the rule and the unmarked rules reachable from it
+	void mark(rule* r) {
+		m_index[r] = m_low[r] = m_next++;
+		m_stack.push_back(r);
+		bool self = false;
+		std::vector<rule*> refs;
+		if (_expr* body = _private::get_expr(*r)) {
+			_collect_refs(body, refs);
+		}
+		for (rule* ref : refs) {
+			if (ref == r) self = true;
+			if (_private::get_recursive(*ref) != _private::_UNKNOWN) continue;
+			auto it = m_index.find(ref);
+			if (it == m_index.end()) {
+				mark(ref);
+				m_low[r] = std::min(m_low[r], m_low[ref]);
+			} else {
+				// an unmarked rule already indexed is still on the stack
+				m_low[r] = std::min(m_low[r], it->second);
+			}
+		}
+		if (m_low[r] != m_index[r]) return;
+		auto begin = m_stack.end();
+		while (*--begin != r) { }
+		bool recursive = self || m_stack.end() - begin > 1;
+		for (auto it = begin; it != m_stack.end(); ++it) {
+			_private::set_recursive(**it, recursive ? _private::_RECURSIVE : _private::_NOT_RECURSIVE);
+		}
+		m_stack.erase(begin, m_stack.end());
+	}
+
+private:
+	std::unordered_map<rule*, size_t> m_index;
+	std::unordered_map<rule*, size_t> m_low;
+	std::vector<rule*> m_stack;
+	size_t m_next = 0;
+};
+
+// max number of instructions of a rule body to be inlined
+static const uint32_t _INLINE_SIZE = 4096;
+
+// the body of a rule which records no match, is not memoized and can not
+// recurse is inlined, since such a rule needs no state of its own;
+// a body with a commit keeps its own backtrack entries to drop
+void _ref::compile(_program& prog) const {
+	_expr* body = _private::get_expr(m_rule);
+	if (prog.m_inline_rules && body && !_private::get_parse_proc(m_rule) && !_private::get_memo(m_rule) && !_private::get_token(m_rule)) {
+		if (_private::get_recursive(m_rule) == _private::_UNKNOWN) {
+			// the rules not reached by optimize() are marked here, one finder
+			// at a time, since a finder skips the rules already marked
+			static std::mutex mutex;
+			std::lock_guard<std::mutex> lock(mutex);
+			if (_private::get_recursive(m_rule) == _private::_UNKNOWN) {
+				_recursion_finder().mark(m_rule.this_ptr());
+			}
+		}
+		if (_private::get_recursive(m_rule) == _private::_NOT_RECURSIVE) {
+			uint32_t begin = prog.here();
+			body->compile(prog);
+			auto cut = std::find_if(prog.m_code.begin() + begin, prog.m_code.end(), [](const _instr& ins) {
+				return ins.m_op == OPCODE::CUT;
+			});
+			if (prog.here() - begin <= _INLINE_SIZE && cut == prog.m_code.end()) return;
+			prog.m_code.resize(begin);
+		}
+	}
+	prog.emit(OPCODE::CALL, prog.add(prog.m_rules, m_rule.this_ptr()));
+}
+
+// compile the expression of a rule
+_program::_program(const _expr* e, bool inline_rules)
+	: m_inline_rules(inline_rules) {
+	if (e) {
+		e->compile(*this);
+	} else {
+		emit(OPCODE::FAIL);
+	}
+	emit(OPCODE::RETURN);
+	m_firsts.clear();
+}
+
+// get the compiled instructions of the rule, compiling them on first use.
+const _program& _private::get_program(rule& r, bool profiling) {
+	auto& program = profiling ? r.m_profile_program : r.m_program;
+	_program* prog = program.load(std::memory_order_acquire);
+	if (!prog) {
+		auto compiled = new _program(r.m_expr, !profiling);
+		if (program.compare_exchange_strong(prog, compiled, std::memory_order_acq_rel)) {
+			prog = compiled;
+		} else {
+			delete compiled;
+		}
+	}
+	return *prog;
+}
+
+// run the instructions of a rule.
+// with GCC and Clang every instruction dispatches the next one by itself,
+// which predicts much better than a shared switch.
+#if defined(__GNUC__)
+#define _VM_CASE(op) _op_##op
+#define _VM_NEXT() goto* dispatch[static_cast<int>((ins = ip++)->m_op)]
+#define _VM_FAIL() goto _fail
+#else // __GNUC__
+#define _VM_CASE(op) case OPCODE::op
+#define _VM_NEXT() continue
+#define _VM_FAIL() break
+#endif // __GNUC__
+
+bool _context::_run(const _program& prog) {
+	// take the backtrack entries of the rule, they are moved
+	// when a called rule grows the vector
+	size_t base = m_backtrack_top;
+	m_backtrack_top += prog.m_depth;
+	if (m_backtrack_top > m_backtracks.size()) {
+		m_backtracks.resize(m_backtrack_top * 2);
+	}
+	_backtrack* stack = m_backtracks.data() + base;
+	_backtrack* top = stack;
+	const _instr* code = prog.m_code.data();
+	const _instr* ip = code;
+	const _instr* ins = nullptr;
+#if defined(__GNUC__)
+	static void* const dispatch[] = {
+		&&_op_CHAR,
+		&&_op_STRING,
+		&&_op_SET,
+		&&_op_LARGER,
+		&&_op_SCAN,
+		&&_op_ANY,
+		&&_op_END_OF_INPUT,
+		&&_op_FAIL,
+		&&_op_CALL,
+		&&_op_TEST,
+		&&_op_CHOICE,
+		&&_op_COMMIT,
+		&&_op_PARTIAL_COMMIT,
+		&&_op_BACK_COMMIT,
+		&&_op_FAIL_TWICE,
+		&&_op_CUT,
+		&&_op_USER_BEGIN,
+		&&_op_USER_END,
+		&&_op_RETURN};
+	_VM_NEXT();
+#else // __GNUC__
+	for (;;) {
+		ins = ip++;
+		switch (ins->m_op) {
+#endif // __GNUC__
+		_VM_CASE(CHAR):
+			if (!end() && symbol() == ins->m_arg) {
+				next_col();
+				_VM_NEXT();
+			}
+			set_error_pos();
+			_VM_FAIL();
+		_VM_CASE(STRING):
+			if (prog.m_strings[ins->m_arg]->match(*this)) _VM_NEXT();
+			_VM_FAIL();
+		_VM_CASE(SET):
+			if (prog.m_sets[ins->m_arg]->match(*this)) _VM_NEXT();
+			_VM_FAIL();
+		_VM_CASE(LARGER):
+			if (prog.m_largers[ins->m_arg]->match(*this)) _VM_NEXT();
+			_VM_FAIL();
+		_VM_CASE(SCAN):
+			prog.m_scans[ins->m_arg]->match(*this);
+			_VM_NEXT();
+		_VM_CASE(ANY):
+			if (!end()) {
+				size_t len = 1;
+				if (symbol() >= 0x80) {
+					code_point(len);
+				}
+				next_col(len);
+				_VM_NEXT();
+			}
+			set_error_pos();
+			_VM_FAIL();
+		_VM_CASE(END_OF_INPUT):
+			if (end()) _VM_NEXT();
+			_VM_FAIL();
+		_VM_CASE(FAIL):
+			_VM_FAIL();
+		_VM_CASE(CALL) : {
+			size_t level = top - stack;
+			bool ok = parse_non_term(*prog.m_rules[ins->m_arg]);
+			stack = m_backtracks.data() + base;
+			top = stack + level;
+			if (ok) _VM_NEXT();
+			_VM_FAIL();
+		}
+		_VM_CASE(TEST) : {
+			// at the end of input the alternative is tried, so it fails as it did
+			const _test& test = prog.m_tests[ins->m_arg];
+			if (end() || test.m_bytes[symbol()]) _VM_NEXT();
+			set_error_pos();
+			if (test.m_next == _test::FAIL) _VM_FAIL();
+			ip = code + test.m_next;
+			_VM_NEXT();
+		}
+		_VM_CASE(CHOICE):
+			// the fields are stored one by one, so that reading them
+			// back on backtracking can be forwarded from the stores
+			top->m_pos = m_pos;
+			top->m_results = static_cast<uint32_t>(m_results);
+			top->m_matches = static_cast<uint32_t>(m_matches.size());
+			top->m_resume = ins->m_arg;
+			++top;
+			_VM_NEXT();
+		_VM_CASE(COMMIT):
+			--top;
+			ip = code + ins->m_arg;
+			_VM_NEXT();
+		_VM_CASE(PARTIAL_COMMIT) : {
+			_backtrack& bt = top[-1];
+			bt.m_pos = m_pos;
+			bt.m_results = static_cast<uint32_t>(m_results);
+			bt.m_matches = static_cast<uint32_t>(m_matches.size());
+			// a commit in the last iteration does not bind the next one
+			bt.m_resume &= ~_backtrack::CUT;
+			ip = code + ins->m_arg;
+			_VM_NEXT();
+		}
+		_VM_CASE(BACK_COMMIT):
+			restore(*--top);
+			ip = code + ins->m_arg;
+			_VM_NEXT();
+		_VM_CASE(FAIL_TWICE):
+			restore(*--top);
+			_VM_FAIL();
+		_VM_CASE(CUT):
+			for (_backtrack* bt = stack; bt != top; ++bt) {
+				if (bt->m_resume != _backtrack::USER) {
+					bt->m_resume |= _backtrack::CUT;
+				}
+			}
+			_VM_NEXT();
+		_VM_CASE(USER_BEGIN):
+			top->m_pos = m_pos;
+			top->m_resume = _backtrack::USER;
+			++top;
+			_VM_NEXT();
+		_VM_CASE(USER_END) : {
+			pos b = make_pos((--top)->m_pos);
+			pos e = make_pos(m_pos);
+			item_t item = {&b, &e, m_user_data};
+			++m_user_calls;
+			if ((*prog.m_handlers[ins->m_arg])(item)) _VM_NEXT();
+			_VM_FAIL();
+		}
+		_VM_CASE(RETURN):
+			assert(top == stack);
+			m_backtrack_top = base;
 			return true;
+#if !defined(__GNUC__)
 		}
-		con.set_error_pos();
-		return false;
-	}
-};
-
-// true
-class _true : public _expr {
-public:
-	// parse with whitespace
-	virtual bool parse_non_term(_context&) const override {
-		return true;
+#else // __GNUC__
+	_fail:
+#endif // __GNUC__
+		// resume at the last choice of the rule, a resolved left recursion
+		// or a committed choice returns without trying any alternative
+		for (;;) {
+			if (top == stack || m_lr_exit) {
+				m_backtrack_top = base;
+				return false;
+			}
+			const _backtrack& bt = *--top;
+			if (bt.m_resume != _backtrack::USER) {
+				if (bt.m_resume & _backtrack::CUT) {
+					m_backtrack_top = base;
+					return false;
+				}
+				restore(bt);
+				ip = code + bt.m_resume;
+				break;
+			}
+		}
+#if defined(__GNUC__)
+		_VM_NEXT();
+#else // __GNUC__
 	}
+#endif // __GNUC__
+}
 
-	// parse terminal
-	virtual bool parse_term(_context&) const override {
-		return true;
-	}
-};
+#undef _VM_CASE
+#undef _VM_NEXT
+#undef _VM_FAIL
 
-// false
-class _false : public _expr {
-public:
-	// parse with whitespace
-	virtual bool parse_non_term(_context&) const override {
-		return false;
+// counts the left recursions being resolved
+struct _lr_guard {
+	int& m_depth;
+	_lr_guard(int& depth)
+		: m_depth(depth) {
+		++m_depth;
 	}
-
-	// parse terminal
-	virtual bool parse_term(_context&) const override {
-		return false;
+	~_lr_guard() {
+		--m_depth;
 	}
 };
 
-// exception thrown when left recursion terminates successfully
-struct _lr_ok {
-	rule* m_rule;
-	_lr_ok(rule* r)
-		: m_rule(r) { }
-};
-
 // constructor
 _state::_state(_context& con)
 	: m_pos(con.m_pos)
+	, m_results(con.m_results)
 	, m_matches(con.m_matches.size()) {
 }
 
-// parse non-term rule.
-bool _context::parse_non_term(rule& r) {
-	// save the state of the rule
-	rule::_state old_state = r.m_state;
-	// restore the rule's state
-	rule::_state_guard quard(old_state, &r.m_state);
-
-	// success/failure result
-	bool ok = false;
-
-	// compute the new position
-	size_t new_pos = m_pos.m_it - m_begin;
-
-	// check if we have left recursion
-	bool lr = new_pos == r.m_state.m_pos;
-
-	// update the rule's state
-	r.m_state.m_pos = new_pos;
-
-	// handle the mode of the rule
-	switch (r.m_state.m_mode) {
-		// normal parse
-		case rule::_PARSE:
-			if (lr) {
-				// first try to parse the rule by rejecting it, so alternative branches are examined
-				r.m_state.m_mode = rule::_REJECT;
-				ok = _parse_non_term(r);
-
-				// if the first try is successful, try accepting the rule,
-				// so other elements of the sequence are parsed
-				if (ok) {
-					r.m_state.m_mode = rule::_ACCEPT;
-
-					// loop until no more parsing can be done
-					for (;;) {
-						// store the correct state, in order to backtrack if the call fails
-						_state st(*this);
+// check if any user handler can be reached from the expression.
+static bool _has_user(_expr* e, std::unordered_set<rule*>& visited) {
+	switch (e->get_type()) {
+		case EXPR_TYPE::USER:
+			return true;
+		case EXPR_TYPE::REF: {
+			rule& r = static_cast<_ref*>(e)->get_rule();
+			if (!visited.insert(r.this_ptr()).second) return false;
+			_expr* body = _private::get_expr(r);
+			return body && _has_user(body, visited);
+		}
+		default: {
+			bool result = false;
+			e->visit_children([&](_expr* child) {
+				result = result || _has_user(child, visited);
+			});
+			return result;
+		}
+	}
+}
 
-						// update the rule position to the current position,
-						// because at this state the rule is resolving the left recursion
-						r.m_state.m_pos = m_pos.m_it - m_begin;
+// check if the rule reaches no user handler.
+bool _context::_is_pure(rule& r) {
+	if (m_purity.empty()) {
+		m_purity.resize(m_states.size(), _UNKNOWN);
+	}
+	char& purity = m_purity[r.m_id];
+	if (purity == _UNKNOWN) {
+		purity = reaches_user(r) ? _IMPURE : _PURE;
+	}
+	return purity == _PURE;
+}
 
-						// if parsing fails, restore the last good state and stop
-						if (!_parse_non_term(r)) {
-							restore(st);
-							break;
-						}
-					}
+// parse rule with the memo table.
+bool _context::_parse_memo(rule& r) {
+	_memo_key key{r.this_ptr(), m_pos};
+	auto it = m_memo.find(key);
+	if (it != m_memo.end()) {
+		++m_memo_stats.hits;
+		if (m_profiler) m_profiler->memo(true);
+		const _memo& memo = it->second;
+		if (memo.m_error_pos > m_error_pos) {
+			m_error_pos = memo.m_error_pos;
+		}
+		if (!memo.m_ok) return false;
+		size_t from = m_matches.size();
+		m_matches.insert(m_matches.end(), memo.m_matches.begin(), memo.m_matches.end());
+		do_parse_procs(from);
+		if (m_memo_depth == 0) {
+			m_matches.resize(from);
+		}
+		m_pos = memo.m_end;
+		return true;
+	}
+	++m_memo_stats.misses;
+	if (m_profiler) m_profiler->memo(false);
+
+	// track the furthest error position of the rule alone
+	_offset error_pos = m_error_pos;
+	m_error_pos = m_pos;
+	size_t matches = m_matches.size();
+	++m_memo_depth;
+	bool ok = _parse_non_term(r);
+	--m_memo_depth;
+
+	// the result of a left recursion depends on its callers
+	if (m_lr_exit) {
+		if (error_pos > m_error_pos) {
+			m_error_pos = error_pos;
+		}
+		// since left recursions may be mutual, we must test which rule's left recursion
+		// was ended successfully
+		if (m_lr_exit != r.this_ptr()) return false;
+		_lr_resolved();
+		return true;
+	}
 
-					// since the left recursion was resolved successfully,
-					// return via a non-local exit
-					throw _lr_ok(r.this_ptr());
-				}
-			} else {
-				try {
-					ok = _parse_non_term(r);
-				} catch (const _lr_ok& ex) {
-					// since left recursions may be mutual, we must test which rule's left recursion
-					// was ended successfully
-					if (ex.m_rule == r.this_ptr()) {
-						ok = true;
-					} else {
-						throw;
-					}
-				}
-			}
-			break;
+	_memo& memo = m_memo[key];
+	memo.m_ok = ok;
+	memo.m_end = m_pos;
+	memo.m_error_pos = m_error_pos;
+	if (ok) {
+		memo.m_matches.assign(m_matches.begin() + matches, m_matches.end());
+	} else {
+		memo.m_matches.clear();
+	}
+	if (m_memo_depth == 0) {
+		m_matches.resize(matches);
+	}
+	if (error_pos > m_error_pos) {
+		m_error_pos = error_pos;
+	}
+	return ok;
+}
 
-		// reject the left recursive rule
-		case rule::_REJECT:
-			if (lr) {
-				ok = false;
-			} else {
-				r.m_state.m_mode = rule::_PARSE;
-				ok = _parse_non_term(r);
-				r.m_state.m_mode = rule::_REJECT;
-			}
-			break;
+// parse rule with the token table.
+bool _context::_parse_token(rule& r) {
+	auto found = m_token_index.find(m_pos);
+	uint32_t first = found == m_token_index.end() ? 0 : found->second;
+	for (uint32_t i = first; i; i = m_tokens[i - 1].m_next) {
+		const _token& token = m_tokens[i - 1];
+		if (token.m_rule != r.this_ptr()) continue;
+		if (token.m_error_pos > m_error_pos) {
+			m_error_pos = token.m_error_pos;
+		}
+		for (uint32_t k = 0; k < token.m_count; ++k) {
+			m_stack->push_kept(m_token_results[token.m_results + k]);
+		}
+		m_results += token.m_count;
+		m_pos = token.m_end;
+		return true;
+	}
 
-		// accept the left recursive rule
-		case rule::_ACCEPT:
-			if (lr) {
-				ok = true;
-			} else {
-				r.m_state.m_mode = rule::_PARSE;
-				ok = _parse_non_term(r);
-				r.m_state.m_mode = rule::_ACCEPT;
-			}
-			break;
+	// track the furthest error position of the rule alone
+	_offset begin = m_pos;
+	_offset error_pos = m_error_pos;
+	m_error_pos = m_pos;
+	size_t results = m_results;
+	size_t user_calls = m_user_calls;
+	bool ok = _parse_non_term(r);
+
+	// since left recursions may be mutual, we must test which rule's left recursion
+	// was ended successfully
+	if (m_lr_exit == r.this_ptr()) {
+		_lr_resolved();
+		ok = true;
+	} else if (ok && !m_lr_exit && m_user_calls == user_calls && m_results >= results) {
+		// a parse without user handlers depends only on the input
+		size_t kept = m_token_results.size();
+		for (size_t k = results; k < m_results; ++k) {
+			m_token_results.push_back(m_stack->keep(k));
+		}
+		if (std::find(m_token_results.begin() + kept, m_token_results.end(), nullptr) == m_token_results.end()) {
+			_token token;
+			token.m_rule = r.this_ptr();
+			token.m_end = m_pos;
+			token.m_error_pos = m_error_pos;
+			token.m_results = static_cast<uint32_t>(kept);
+			token.m_count = static_cast<uint32_t>(m_results - results);
+			uint32_t& head = m_token_index[begin];
+			token.m_next = head;
+			m_tokens.push_back(token);
+			head = static_cast<uint32_t>(m_tokens.size());
+		} else {
+			m_token_results.resize(kept);
+		}
+	}
+	if (error_pos > m_error_pos) {
+		m_error_pos = error_pos;
 	}
+	return ok;
+}
 
+// parse non-term rule, counting the call when profiling.
+bool _context::parse_non_term(rule& r) {
+	spend(1);
+	if (!m_profiler) return _parse_rule(r);
+	_offset begin = m_pos;
+	m_profiler->enter(r.m_id, r.this_ptr());
+	bool ok = _parse_rule(r);
+	m_profiler->leave(ok, m_pos - begin);
 	return ok;
 }
 
-// parse term rule.
-bool _context::parse_term(rule& r) {
+// parse non-term rule, resolving its left recursion.
+bool _context::_parse_rule(rule& r) {
 	// save the state of the rule
-	rule::_state old_state = r.m_state;
+	rule::_state& state = state_of(r);
+	rule::_state old_state = state;
 	// restore the rule's state
-	rule::_state_guard quard(old_state, &r.m_state);
+	rule::_state_guard quard(old_state, &state);
 
 	// success/failure result
 	bool ok = false;
 
 	// compute the new position
-	size_t new_pos = m_pos.m_it - m_begin;
+	size_t new_pos = m_pos;
 
 	// check if we have left recursion
-	bool lr = new_pos == r.m_state.m_pos;
+	bool lr = new_pos == state.m_pos;
 
 	// update the rule's state
-	r.m_state.m_pos = new_pos;
+	state.m_pos = new_pos;
 
 	// handle the mode of the rule
-	switch (r.m_state.m_mode) {
+	switch (state.m_mode) {
 		// normal parse
 		case rule::_PARSE:
 			if (lr) {
+				// memoized results do not apply while resolving the left recursion,
+				// and the matches are logged until it is resolved
+				if (m_lr_depth == 0) {
+					m_lr_matches = m_matches.size();
+				}
+				_lr_guard lr_guard(m_lr_depth);
+
 				// first try to parse the rule by rejecting it, so alternative branches are examined
-				r.m_state.m_mode = rule::_REJECT;
-				ok = _parse_term(r);
+				state.m_mode = rule::_REJECT;
+				ok = _parse_non_term(r);
 
 				// if the first try is successful, try accepting the rule,
 				// so other elements of the sequence are parsed
 				if (ok) {
-					r.m_state.m_mode = rule::_ACCEPT;
+					state.m_mode = rule::_ACCEPT;
 
 					// loop until no more parsing can be done
 					for (;;) {
@@ -1037,30 +2306,33 @@ bool _context::parse_term(rule& r) {
 
 						// update the rule position to the current position,
 						// because at this state the rule is resolving the left recursion
-						r.m_state.m_pos = m_pos.m_it - m_begin;
+						state.m_pos = m_pos;
 
-						// if parsing fails, restore the last good state and stop
-						if (!_parse_term(r)) {
+						// if parsing fails, restore the last good state and stop,
+						// unless another left recursion is returning
+						if (!_parse_non_term(r)) {
+							if (m_lr_exit) return false;
 							restore(st);
 							break;
 						}
 					}
 
 					// since the left recursion was resolved successfully,
-					// return via a non-local exit
-					throw _lr_ok(r.this_ptr());
+					// fail all the way back to the invocation which started it
+					m_lr_exit = r.this_ptr();
+					ok = false;
 				}
+			} else if (_use_memo(r)) {
+				ok = _parse_memo(r);
+			} else if (_use_token(r)) {
+				ok = _parse_token(r);
 			} else {
-				try {
-					ok = _parse_term(r);
-				} catch (const _lr_ok& ex) {
-					// since left recursions may be mutual, we must test which rule's left recursion
-					// was ended successfully
-					if (ex.m_rule == r.this_ptr()) {
-						ok = true;
-					} else {
-						throw;
-					}
+				ok = _parse_non_term(r);
+				// since left recursions may be mutual, we must test which rule's left recursion
+				// was ended successfully
+				if (m_lr_exit == r.this_ptr()) {
+					_lr_resolved();
+					ok = true;
 				}
 			}
 			break;
@@ -1070,9 +2342,9 @@ bool _context::parse_term(rule& r) {
 			if (lr) {
 				ok = false;
 			} else {
-				r.m_state.m_mode = rule::_PARSE;
-				ok = _parse_term(r);
-				r.m_state.m_mode = rule::_REJECT;
+				state.m_mode = rule::_PARSE;
+				ok = _parse_non_term(r);
+				state.m_mode = rule::_REJECT;
 			}
 			break;
 
@@ -1081,9 +2353,9 @@ bool _context::parse_term(rule& r) {
 			if (lr) {
 				ok = true;
 			} else {
-				r.m_state.m_mode = rule::_PARSE;
-				ok = _parse_term(r);
-				r.m_state.m_mode = rule::_ACCEPT;
+				state.m_mode = rule::_PARSE;
+				ok = _parse_non_term(r);
+				state.m_mode = rule::_ACCEPT;
 			}
 			break;
 	}
@@ -1094,41 +2366,113 @@ bool _context::parse_term(rule& r) {
 // parse non-term rule internal.
 bool _context::_parse_non_term(rule& r) {
 	bool ok = false;
+	const _program& prog = _private::get_program(r, m_profiler != nullptr);
 	if (_private::get_parse_proc(r)) {
-		pos b = m_pos;
-		ok = _private::get_expr(r)->parse_non_term(*this);
+		_offset b = m_pos;
+		ok = _run(prog);
 		if (ok) {
-			m_matches.push_back(_match(r.this_ptr(), b, m_pos));
+			m_rules[r.m_id] = r.this_ptr();
+			if (m_lr_depth > 0 || m_memo_depth > 0) {
+				m_matches.push_back(_match(static_cast<uint32_t>(r.m_id), b, m_pos));
+			}
+			if (m_lr_depth == 0) {
+				do_parse_proc(r, b, m_pos);
+			}
 		}
 	} else {
-		ok = _private::get_expr(r)->parse_non_term(*this);
+		ok = _run(prog);
 	}
 	return ok;
 }
 
-// parse term rule internal.
-bool _context::_parse_term(rule& r) {
-	bool ok = false;
-	if (_private::get_parse_proc(r)) {
-		pos b = m_pos;
-		ok = _private::get_expr(r)->parse_term(*this);
-		if (ok) {
-			m_matches.push_back(_match(r.this_ptr(), b, m_pos));
-		}
-	} else {
-		ok = _private::get_expr(r)->parse_term(*this);
+// reports the memoization counters when a parse returns
+struct _memo_report {
+	_context& m_con;
+	memo_stats* m_stats;
+	~_memo_report() {
+		if (m_stats) *m_stats = m_con.m_memo_stats;
 	}
-	return ok;
-}
+};
+
+// reports the counters of the rules when a profiled parse returns
+struct _profile_report {
+	_context& m_con;
+	parse_profile* m_profile;
+	~_profile_report() {
+		if (m_profile) m_con.m_profiler->report(*m_profile);
+	}
+};
 
 // get syntax error
 static error _syntax_error(_context& con) {
-	return error(con.m_error_pos, con.m_error_pos, ERROR_SYNTAX_ERROR);
+	pos p = con.make_pos(con.m_error_pos);
+	return error(p, p, ERROR_SYNTAX_ERROR);
 }
 
 // get eof error
 static error _eof_error(_context& con) {
-	return error(con.m_error_pos, con.m_error_pos, ERROR_INVALID_EOF);
+	pos p = con.make_pos(con.m_error_pos);
+	return error(p, p, ERROR_INVALID_EOF);
+}
+
+// get budget error
+static error _budget_error(_context& con) {
+	pos p = con.make_pos(con.m_pos);
+	return error(p, p, ERROR_BUDGET_EXCEEDED);
+}
+
+/** checks if the given text is well-formed UTF-8.
+	@param s text.
+	@return true if it is well-formed, false otherwise.
+*/
+bool utf8_valid(std::string_view s) {
+	auto it = s.begin();
+	auto end = s.end();
+	while (it != end) {
+		auto begin = it;
+		char32_t ch = utf8_next(it, end);
+		size_t len = it - begin;
+		size_t expected = ch < 0x80 ? 1 : ch < 0x800 ? 2 : ch < 0x10000 ? 3 : 4;
+		if ((len == 1 && ch >= 0x80) || len != expected || ch > 0x10FFFF || (ch >= 0xD800 && ch <= 0xDFFF)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// ids of the rules, reused after a rule is destroyed
+struct _rule_id_pool {
+	std::mutex m_mutex;
+	size_t m_count = 0;
+	std::vector<size_t> m_free;
+};
+
+static _rule_id_pool& _rule_ids() {
+	static _rule_id_pool pool;
+	return pool;
+}
+
+size_t rule::_new_id() {
+	auto& ids = _rule_ids();
+	std::lock_guard<std::mutex> lock(ids.m_mutex);
+	if (!ids.m_free.empty()) {
+		size_t id = ids.m_free.back();
+		ids.m_free.pop_back();
+		return id;
+	}
+	return ids.m_count++;
+}
+
+void rule::_free_id(size_t id) {
+	auto& ids = _rule_ids();
+	std::lock_guard<std::mutex> lock(ids.m_mutex);
+	ids.m_free.push_back(id);
+}
+
+size_t _private::rule_count() {
+	auto& ids = _rule_ids();
+	std::lock_guard<std::mutex> lock(ids.m_mutex);
+	return ids.m_count;
 }
 
 /** constructor from input.
@@ -1246,8 +2590,6 @@ rule::rule(const expr& e)
 	: m_expr(_private::get_expr(e))
 	, m_parse_proc(nullptr) { }
 
-#ifndef NDEBUG
-
 /** constructor from a expression name.
 	@param name name of expression.
 */
@@ -1256,8 +2598,6 @@ rule::rule(const char* name, rule::initTag)
 	, m_name(name)
 	, m_parse_proc(nullptr) { }
 
-#endif // NDEBUG
-
 /** constructor from rule.
 	@param r rule.
 */
@@ -1266,11 +2606,15 @@ rule::rule(rule& r)
 	, m_parse_proc(nullptr) { }
 
 rule& rule::operator=(rule& r) {
+	delete m_program.exchange(nullptr);
+	delete m_profile_program.exchange(nullptr);
 	m_expr = new _ref(r);
 	return *this;
 }
 
 rule& rule::operator=(const expr& e) {
+	delete m_program.exchange(nullptr);
+	delete m_profile_program.exchange(nullptr);
 	m_expr = _private::get_expr(e);
 	return *this;
 }
@@ -1285,7 +2629,10 @@ rule::rule(const rule&) {
 /** deletes the internal object that represents the expression.
  */
 rule::~rule() {
+	delete m_program.load();
+	delete m_profile_program.load();
 	delete m_expr;
+	_free_id(m_id);
 }
 
 /** creates a zero-or-more loop out of this rule.
@@ -1419,12 +2766,276 @@ expr operator>>(expr&& left, expr&& right) {
 	}
 }
 
+// check if the expression matches a single code point out of a set.
+static bool _is_set(const _expr* e) {
+	switch (e->get_type()) {
+		case EXPR_TYPE::SET:
+			return true;
+		case EXPR_TYPE::CHAR:
+			return static_cast<const _char*>(e)->get_char() < 0x80;
+		case EXPR_TYPE::LARGER:
+			return static_cast<const _larger*>(e)->get_value() < SIZE_MAX;
+		default:
+			return false;
+	}
+}
+
+// get the expression as a set, a character or a right interval is replaced.
+static _set* _take_set(_expr* e) {
+	_set* set = nullptr;
+	switch (e->get_type()) {
+		case EXPR_TYPE::SET:
+			return static_cast<_set*>(e);
+		case EXPR_TYPE::CHAR: {
+			size_t ch = static_cast<_char*>(e)->get_char();
+			set = new _set(ch, ch);
+			break;
+		}
+		case EXPR_TYPE::LARGER:
+			set = new _set(static_cast<_larger*>(e)->get_value() + 1, SIZE_MAX);
+			break;
+		default:
+			assert(false);
+			break;
+	}
+	delete e;
+	return set;
+}
+
+// merge two adjacent alternatives which are sets into one set,
+// since a choice of them matches the same single code point.
+static _set* _merge_sets(_expr* left, _expr* right) {
+	if (!_is_set(left) || !_is_set(right)) return nullptr;
+	_set* set = _take_set(left);
+	_set* other = _take_set(right);
+	set->merge(*other);
+	delete other;
+	return set;
+}
+
+// rewrites the expressions of the rules to parse the same input
+// with fewer expressions, before any of them is compiled
+class _optimizer {
+public:
+	// optimize the rules and the rules they reach,
+	// return the number of expressions removed
+	size_t run(const std::vector<rule*>& rules) {
+		std::vector<rule*> pending;
+		for (rule* r : rules) {
+			if (m_visited.insert(r).second) pending.push_back(r);
+		}
+		size_t removed = 0;
+		while (!pending.empty()) {
+			rule* next = pending.back();
+			pending.pop_back();
+			_expr* body = _private::get_expr(*next);
+			if (!body) continue;
+			size_t count = _count(body);
+			body = _optimize(body, pending);
+			_private::set_expr(*next, body);
+			removed += count - _count(body);
+		}
+		// mark the recursion of the rules before any thread compiles them
+		_recursion_finder finder;
+		for (rule* r : m_visited) {
+			if (_private::get_recursive(*r) == _private::_UNKNOWN) {
+				finder.mark(r);
+			}
+		}
+		return removed;
+	}
+
+private:
+	std::unordered_set<rule*> m_visited;
+
+	// count the expressions of a rule body
+	static size_t _count(const _expr* e) {
+		size_t count = 1;
+		e->visit_children([&](_expr* child) {
+			count += _count(child);
+		});
+		return count;
+	}
+
+	// optimize the sub expressions first, then the expression itself
+	_expr* _optimize(_expr* e, std::vector<rule*>& pending) {
+		e->rewrite_children([&](_expr* child) {
+			return _optimize(child, pending);
+		});
+		switch (e->get_type()) {
+			case EXPR_TYPE::REF: {
+				rule& r = static_cast<_ref*>(e)->get_rule();
+				if (m_visited.insert(r.this_ptr()).second) {
+					pending.push_back(r.this_ptr());
+				}
+				return e;
+			}
+			case EXPR_TYPE::SEQ_TWO:
+			case EXPR_TYPE::SEQ_LIST:
+				return _optimize_seq(_take_list(e));
+			case EXPR_TYPE::CHOICE_TWO:
+			case EXPR_TYPE::CHOICE_LIST:
+				return _optimize_choice(_take_list(e));
+			default:
+				return e;
+		}
+	}
+
+	// take the operands of a sequence or of a choice, nested ones of the
+	// same kind are spliced in since both are associative
+	static std::vector<_expr*> _take_list(_expr* e) {
+		std::vector<_expr*> list;
+		_splice(e, e->get_type(), list);
+		return list;
+	}
+
+	static void _splice(_expr* e, EXPR_TYPE type, std::vector<_expr*>& list) {
+		bool seq = type == EXPR_TYPE::SEQ_TWO || type == EXPR_TYPE::SEQ_LIST;
+		switch (e->get_type()) {
+			case EXPR_TYPE::SEQ_TWO:
+			case EXPR_TYPE::CHOICE_TWO: {
+				if (seq != (e->get_type() == EXPR_TYPE::SEQ_TWO)) break;
+				auto binary = static_cast<_binary*>(e);
+				_splice(binary->m_left, type, list);
+				_splice(binary->m_right, type, list);
+				binary->m_left = nullptr;
+				binary->m_right = nullptr;
+				delete binary;
+				return;
+			}
+			case EXPR_TYPE::SEQ_LIST: {
+				if (!seq) break;
+				auto seq_list = static_cast<_seq_list*>(e);
+				for (_expr* item : seq_list->m_list) {
+					_splice(item, type, list);
+				}
+				seq_list->m_list.clear();
+				delete seq_list;
+				return;
+			}
+			case EXPR_TYPE::CHOICE_LIST: {
+				if (seq) break;
+				auto choice_list = static_cast<_choice_list*>(e);
+				for (_expr* item : choice_list->m_list) {
+					_splice(item, type, list);
+				}
+				choice_list->m_list.clear();
+				delete choice_list;
+				return;
+			}
+			default:
+				break;
+		}
+		list.push_back(e);
+	}
+
+	// the characters and strings an expression matches in a row,
+	// an empty string if it is not a literal
+	static input _literal(const _expr* e) {
+		switch (e->get_type()) {
+			case EXPR_TYPE::CHAR:
+				return input(1, static_cast<char>(static_cast<const _char*>(e)->get_char()));
+			case EXPR_TYPE::STRING:
+				return static_cast<const _string*>(e)->get_string();
+			default:
+				return {};
+		}
+	}
+
+	// adjacent literals are matched as one string, failing at the same position
+	static _expr* _optimize_seq(std::vector<_expr*>&& list) {
+		std::vector<_expr*> merged;
+		for (size_t i = 0; i < list.size();) {
+			input literal = _literal(list[i]);
+			size_t j = i + 1;
+			if (!literal.empty()) {
+				for (; j < list.size(); ++j) {
+					input next = _literal(list[j]);
+					if (next.empty()) break;
+					literal += next;
+				}
+			}
+			if (j - i > 1) {
+				for (size_t k = i; k < j; ++k) {
+					delete list[k];
+				}
+				merged.push_back(new _string(std::move(literal)));
+			} else {
+				merged.push_back(list[i]);
+			}
+			i = j;
+		}
+		if (merged.size() == 1) {
+			return merged.front();
+		}
+		auto seq_list = new _seq_list();
+		seq_list->m_list = std::move(merged);
+		return seq_list;
+	}
+
+	// the literal a sequence starts with, when more follows it
+	static input _prefix(const _expr* e) {
+		if (e->get_type() != EXPR_TYPE::SEQ_LIST) return {};
+		auto& list = static_cast<const _seq_list*>(e)->m_list;
+		return list.size() > 1 ? _literal(list.front()) : input{};
+	}
+
+	// adjacent single code point alternatives are merged into a set, and the
+	// literal starting adjacent alternatives is parsed once before them
+	_expr* _optimize_choice(std::vector<_expr*>&& list) {
+		std::vector<_expr*> merged;
+		for (size_t i = 0; i < list.size();) {
+			if (!merged.empty()) {
+				if (auto set = _merge_sets(merged.back(), list[i])) {
+					merged.back() = set;
+					++i;
+					continue;
+				}
+			}
+			input prefix = _prefix(list[i]);
+			size_t j = i + 1;
+			if (!prefix.empty()) {
+				while (j < list.size() && _prefix(list[j]) == prefix) ++j;
+			}
+			if (j - i > 1) {
+				std::vector<_expr*> rests;
+				for (size_t k = i; k < j; ++k) {
+					auto seq_list = static_cast<_seq_list*>(list[k]);
+					std::vector<_expr*> rest(seq_list->m_list.begin() + 1, seq_list->m_list.end());
+					if (k > i) delete seq_list->m_list.front();
+					seq_list->m_list.erase(seq_list->m_list.begin() + 1, seq_list->m_list.end());
+					if (k > i) {
+						seq_list->m_list.clear();
+						delete seq_list;
+					}
+					rests.push_back(_optimize_seq(std::move(rest)));
+				}
+				auto head = static_cast<_seq_list*>(list[i]);
+				head->m_list.push_back(_optimize_choice(std::move(rests)));
+				merged.push_back(head);
+			} else {
+				merged.push_back(list[i]);
+			}
+			i = j;
+		}
+		if (merged.size() == 1) {
+			return merged.front();
+		}
+		auto choice_list = new _choice_list();
+		choice_list->m_list = std::move(merged);
+		return choice_list;
+	}
+};
+
 /** creates a choice of expressions.
 	@param left left operand.
 	@param right right operand.
 	@return an expression which parses a choice.
 */
 expr operator|(const expr& left, const expr& right) {
+	if (auto set = _merge_sets(_private::get_expr(left), _private::get_expr(right))) {
+		return _private::construct_expr(set);
+	}
 	return _private::construct_expr(
 		new _choice(_private::get_expr(left), _private::get_expr(right)));
 }
@@ -1432,9 +3043,16 @@ expr operator|(const expr& left, const expr& right) {
 expr operator|(expr&& left, expr&& right) {
 	auto left_expr = _private::get_expr(left);
 	auto right_expr = _private::get_expr(right);
+	if (auto set = _merge_sets(left_expr, right_expr)) {
+		return _private::construct_expr(set);
+	}
 	switch (left_expr->get_type()) {
 		case EXPR_TYPE::CHOICE_TWO: {
 			auto l_choice = static_cast<_choice*>(left_expr);
+			if (auto set = _merge_sets(l_choice->m_right, right_expr)) {
+				l_choice->m_right = set;
+				return _private::construct_expr(l_choice);
+			}
 			switch (right_expr->get_type()) {
 				case EXPR_TYPE::CHOICE_TWO: {
 					auto r_choice = static_cast<_choice*>(right_expr);
@@ -1478,6 +3096,10 @@ expr operator|(expr&& left, expr&& right) {
 		}
 		case EXPR_TYPE::CHOICE_LIST: {
 			auto l_list = static_cast<_choice_list*>(left_expr);
+			if (auto set = _merge_sets(l_list->m_list.back(), right_expr)) {
+				l_list->m_list.back() = set;
+				return _private::construct_expr(l_list);
+			}
 			switch (right_expr->get_type()) {
 				case EXPR_TYPE::CHOICE_TWO: {
 					auto r_choice = static_cast<_choice*>(right_expr);
@@ -1529,6 +3151,7 @@ expr set(const char* s) {
 	@return an expression which parses a single character out of range.
 */
 expr range(int min, int max) {
+	assert(min >= 0);
 	return _private::construct_expr(new _set(min, max));
 }
 
@@ -1536,6 +3159,23 @@ expr larger(size_t value) {
 	return _private::construct_expr(new _larger(value));
 }
 
+/** creates an expression which skips the input up to one of the given
+	ASCII characters or the end of input.
+	@param s null-terminated string with the ASCII characters to stop at.
+	@return an expression which skips the input.
+*/
+expr scan_until(const char* s) {
+	return _private::construct_expr(new _scan(s, true));
+}
+
+/** creates an expression which skips a run of the given ASCII characters.
+	@param s null-terminated string with the ASCII characters to skip.
+	@return an expression which skips the input.
+*/
+expr scan_while(const char* s) {
+	return _private::construct_expr(new _scan(s, false));
+}
+
 /** creates an expression which increments the line counter
 	and resets the column counter when the given expression
 	is parsed successfully; used for newline characters.
@@ -1588,35 +3228,82 @@ expr false_() {
 	return _private::construct_expr(new _false());
 }
 
+/** parsing succeeds without consuming any input, and the running rule
+	can no longer backtrack into the alternatives enclosing the commit.
+ */
+expr commit_() {
+	return _private::construct_expr(new _commit());
+}
+
 /** parse with target expression and let user handle result.
  */
 expr user(const expr& e, const user_handler& handler) {
 	return _private::construct_expr(new _user(_private::get_expr(e), handler));
 }
 
+/** rewrites the expressions of the rules reached from the given rules
+	to parse the same input with fewer expressions.
+	@param rules rules.
+	@return the number of expressions removed.
+*/
+size_t optimize(const std::vector<rule*>& rules) {
+	return _optimizer().run(rules);
+}
+
+/** checks if the rule can reach a user handler.
+	@param r rule.
+	@return true if a user handler can be reached, or the rule has no expression.
+*/
+bool reaches_user(rule& r) {
+	std::unordered_set<rule*> visited{r.this_ptr()};
+	_expr* e = _private::get_expr(r);
+	return !e || _has_user(e, visited);
+}
+
 /** parses the given input.
-	The parse procedures of each rule parsed are executed
-	before this function returns, if parsing succeeds.
+	The parse procedures of the rules are executed as the rules match,
+	their results left on the stack are those of the successful parse.
 	@param i input.
 	@param g root rule of grammar.
 	@param el list of errors.
-	@param st ast object stack.
-	@param ud user data, passed to the parse procedures.
+	@param st stack of the results, passed to the parse procedures.
+	@param ud user data, passed to the user handlers.
 	@return true on parsing success, false on failure.
 */
-bool parse(input& i, rule& g, error_list& el, void* st, void* ud) {
+bool parse(input& i, rule& g, error_list& el, parse_stack* st, void* ud, const parse_options& opt) {
+	// the input has to be indexed by the offsets of the context
+	if (i.size() >= _context::_MAX_INPUT) {
+		el.push_back(error(pos(i), pos(i), ERROR_INPUT_TOO_LARGE));
+		return false;
+	}
+	if (opt.start > i.size()) {
+		el.push_back(error(pos(i), pos(i), ERROR_SYNTAX_ERROR));
+		return false;
+	}
+
 	// prepare context
-	_context con(i, ud);
+	_context con(i, st, ud, opt);
+
+	// report the memoization counters on return
+	_memo_report memo_report{con, opt.memo};
 
-	// parse grammar
-	if (!con.parse_non_term(g)) {
-		el.push_back(_syntax_error(con));
+	// report the counters of the rules on return
+	_profile_report profile_report{con, opt.profile};
+
+	// parse grammar, until the budget is spent
+	try {
+		if (!con.parse_non_term(g)) {
+			el.push_back(_syntax_error(con));
+			return false;
+		}
+	} catch (const _budget_exceeded&) {
+		el.push_back(_budget_error(con));
 		return false;
 	}
 
 	// if end is not reached, there was an error
 	if (!con.end()) {
-		if (con.m_error_pos.m_it < con.m_end) {
+		if (con.m_error_pos < con.m_size) {
 			el.push_back(_syntax_error(con));
 		} else {
 			el.push_back(_eof_error(con));
@@ -1624,33 +3311,50 @@ bool parse(input& i, rule& g, error_list& el, void* st, void* ud) {
 		return false;
 	}
 
-	// success; execute the parse procedures
-	con.do_parse_procs(st);
 	return true;
 }
 
 /** check the start part of given input.
-	The parse procedures of each rule parsed are executed
-	before this function returns, if parsing succeeds.
+	The parse procedures of the rules are executed as the rules match,
+	their results left on the stack are those of the successful parse.
 	@param i input.
 	@param g root rule of grammar.
 	@param el list of errors.
-	@param st ast object stack.
-	@param ud user data, passed to the parse procedures.
+	@param st stack of the results, passed to the parse procedures.
+	@param ud user data, passed to the user handlers.
 	@return true on parsing success, false on failure.
 */
-bool start_with(input& i, rule& g, error_list& el, void* st, void* ud) {
+bool start_with(input& i, rule& g, error_list& el, parse_stack* st, void* ud, const parse_options& opt) {
+	// the input has to be indexed by the offsets of the context
+	if (i.size() >= _context::_MAX_INPUT) {
+		el.push_back(error(pos(i), pos(i), ERROR_INPUT_TOO_LARGE));
+		return false;
+	}
+	if (opt.start > i.size()) {
+		el.push_back(error(pos(i), pos(i), ERROR_SYNTAX_ERROR));
+		return false;
+	}
+
 	// prepare context
-	_context con(i, ud);
+	_context con(i, st, ud, opt);
 
-	// parse grammar
-	if (!con.parse_non_term(g)) {
-		el.push_back(_syntax_error(con));
+	// report the memoization counters on return
+	_memo_report memo_report{con, opt.memo};
+
+	// report the counters of the rules on return
+	_profile_report profile_report{con, opt.profile};
+
+	// parse grammar, until the budget is spent
+	try {
+		if (!con.parse_non_term(g)) {
+			el.push_back(_syntax_error(con));
+			return false;
+		}
+	} catch (const _budget_exceeded&) {
+		el.push_back(_budget_error(con));
 		return false;
 	}
 
-	// success; execute the parse procedures
-	con.do_parse_procs(st);
 	return true;
 }
 
@@ -17,26 +17,59 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
 #pragma warning(disable : 4521)
 #endif
 
-#include <codecvt>
+#include <atomic>
 #include <functional>
 #include <list>
-#include <locale>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace parserlib {
 
-/// type of the parser's input.
-typedef std::basic_string<wchar_t> input;
+/// type of the parser's input, UTF-8 encoded.
+typedef std::string input;
 typedef input::iterator input_it;
-typedef std::wstring_convert<std::codecvt_utf8_utf16<input::value_type>> Converter;
+
+/** decodes the UTF-8 code point at the given position.
+	An invalid byte is returned as a code point of its own.
+	@param it position of the code point, moved past it.
+	@param end end of the input.
+	@return the code point.
+*/
+template <class It>
+char32_t utf8_next(It& it, It end) {
+	auto lead = static_cast<unsigned char>(*it++);
+	if (lead < 0x80) return lead;
+	int count = lead >= 0xF0 ? 3 : lead >= 0xE0 ? 2 : lead >= 0xC0 ? 1 : 0;
+	char32_t ch = lead & (0x3F >> count);
+	auto next = it;
+	for (int i = 0; i < count; ++i, ++next) {
+		if (next == end || (static_cast<unsigned char>(*next) & 0xC0) != 0x80) {
+			return lead;
+		}
+		ch = (ch << 6) | (static_cast<unsigned char>(*next) & 0x3F);
+	}
+	it = next;
+	return count == 0 ? lead : ch;
+}
+
+/** checks if the given text is well-formed UTF-8.
+	@param s text.
+	@return true if it is well-formed, false otherwise.
+*/
+bool utf8_valid(std::string_view s);
 
 class _private;
 class _expr;
+class _program;
 class _context;
 class rule;
 
-/// position into the input.
+/** position into the input.
+	The parser keeps byte offsets and fills the line and the column
+	only for the positions it reports; lines start after each '\n'
+	and columns count the code points from the start of the line.
+ */
 class pos {
 public:
 	/// interator into the input.
@@ -124,10 +157,46 @@ private:
 	friend class _private;
 };
 
+/** stack of the results built by the parse procedures.
+	The procedure of a rule runs as soon as the rule matches, and may only
+	take the results pushed by the rules matched inside it. When the parse
+	backtracks over a match, the stack is truncated to the size it had.
+*/
+class parse_stack {
+public:
+	virtual ~parse_stack() { }
+
+	/** returns the number of results on the stack.
+	*/
+	virtual size_t size() const = 0;
+
+	/** drops the results above the given size.
+		@param size size to truncate the stack to.
+	*/
+	virtual void truncate(size_t size) = 0;
+
+	/** keeps the result at the given index alive when the stack is
+		truncated, so it can be pushed again by push_kept().
+		@param index index of the result.
+		@return handle of the result, or null if results can not be kept.
+	*/
+	virtual void* keep(size_t index) {
+		(void)index;
+		return nullptr;
+	}
+
+	/** pushes a result kept by keep() again.
+		@param handle handle of the result.
+	*/
+	virtual void push_kept(void* handle) {
+		(void)handle;
+	}
+};
+
 /** type of procedure to invoke when a rule is successfully parsed.
 	@param b begin position of input.
 	@param e end position of input.
-	@param d pointer to user data.
+	@param d stack of the results, given to the parse.
 */
 typedef void (*parse_proc)(const pos& b, const pos& e, void* d);
 
@@ -160,6 +229,12 @@ enum ERROR_TYPE {
 	/// invalid end of file
 	ERROR_INVALID_EOF,
 
+	/// work budget of the parse spent
+	ERROR_BUDGET_EXCEEDED,
+
+	/// input too large to be indexed by the parser
+	ERROR_INPUT_TOO_LARGE,
+
 	/// first user error
 	ERROR_USER = 100
 };
@@ -187,6 +262,76 @@ public:
 /// type of error list.
 typedef std::list<error> error_list;
 
+/// counters of the packrat memoization done in a parse.
+struct memo_stats {
+	/// lookups answered from the memo table.
+	size_t hits = 0;
+
+	/// lookups that had to parse the rule.
+	size_t misses = 0;
+};
+
+/// counters of a rule in a profiled parse.
+struct rule_profile {
+	/// name of the rule, null when the rule has no name.
+	const char* name = nullptr;
+
+	/// number of times the rule was parsed.
+	size_t calls = 0;
+
+	/// number of successful and failed parses.
+	size_t successes = 0;
+	size_t failures = 0;
+
+	/// bytes parsed by the successful parses.
+	size_t consumed = 0;
+
+	/// bytes given back by the alternatives and the predicates of the rule.
+	size_t backtracked = 0;
+
+	/// memo table lookups of the rule answered from the table and parsed.
+	size_t memo_hits = 0;
+	size_t memo_misses = 0;
+
+	/// seconds spent in the rule, with and without the rules it called.
+	double inclusive_time = 0.0;
+	double exclusive_time = 0.0;
+};
+
+/// counters of the rules parsed in a profiled parse.
+typedef std::vector<rule_profile> parse_profile;
+
+/// optional features for a parse.
+struct parse_options {
+	/// memoize every rule that does not reach a user handler,
+	/// besides the rules marked by rule::set_memo().
+	bool memo_all = false;
+
+	/// receives the memoization counters when not null.
+	memo_stats* memo = nullptr;
+
+	/// reuse the results of the rules marked by rule::set_token()
+	/// when they are parsed again at the same position.
+	bool tokens = false;
+
+	/// receives the counters of the rules when not null; the rules
+	/// of a profiled parse are all called instead of being inlined.
+	parse_profile* profile = nullptr;
+
+	/// max work of the parse, counted as the rules called plus the bytes
+	/// given back by backtracking; once spent, the parse stops with an
+	/// ERROR_BUDGET_EXCEEDED error, zero for no limit.
+	size_t budget = 0;
+
+	/// offset of the input where the parse starts, the positions
+	/// are still located in the whole input.
+	size_t start = 0;
+
+	/// line of the start offset, counted from the input begin when zero;
+	/// only the lines from the start on are indexed.
+	int start_line = 0;
+};
+
 /** represents a rule.
  */
 class rule {
@@ -252,7 +397,26 @@ public:
 	*/
 	void set_parse_proc(parse_proc p);
 
+	/** enables packrat memoization of the rule.
+		The result of the rule at an input position is then parsed only once.
+		Only rules whose result does not depend on the user data should be marked.
+		It can be switched between parses; a rule without a parse procedure
+		is only memoized where it was not inlined before being marked.
+		@param on true to memoize the rule.
+	*/
+	void set_memo(bool on = true) { m_memo.store(on, std::memory_order_relaxed); }
+
+	/** marks the rule as a token, whose successful parses are recorded
+		and reused when the rule is parsed again at the same position.
+		A parse running a user handler is not recorded, and the results
+		of the rule must be built only from what it parses.
+		@param on true to mark the rule as a token.
+	*/
+	void set_token(bool on = true) { m_token = on; }
+
 	/** get the this ptr (since operator & is overloaded).
+		The rules are not modified by parsing, so a grammar can be
+		shared by parses running on different threads.
 		@return pointer to this.
 	*/
 	rule* this_ptr() { return this; }
@@ -261,8 +425,6 @@ public:
 
 	rule& operator=(const expr&);
 
-#ifndef NDEBUG
-
 	/** constructor from a expression name.
 		@param name name of expression.
 	*/
@@ -270,8 +432,6 @@ public:
 	rule(const char* name, initTag);
 	const char* get_name() const { return m_name; }
 
-#endif // NDEBUG
-
 private:
 	// mode
 	enum _MODE {
@@ -308,15 +468,33 @@ private:
 	// internal expression
 	_expr* m_expr;
 
-#ifndef NDEBUG
 	const char* m_name = nullptr;
-#endif
 
 	// associated parse procedure.
 	parse_proc m_parse_proc;
 
-	// state
-	_state m_state;
+	// instructions compiled from the expression on first parse
+	std::atomic<_program*> m_program{nullptr};
+
+	// instructions calling every rule, compiled on first profiled parse
+	std::atomic<_program*> m_profile_program{nullptr};
+
+	// whether the rule can reach itself, found on first compile
+	std::atomic<char> m_recursive{0};
+
+	// memoize the results of the rule
+	std::atomic<bool> m_memo{false};
+
+	// reuse the results of the rule at a position
+	bool m_token = false;
+
+	// index of the rule's parse state in a context,
+	// the rule itself is never modified by parsing
+	size_t m_id = _new_id();
+
+	// allocate and free the rule indices
+	static size_t _new_id();
+	static void _free_id(size_t id);
 
 	friend class _private;
 	friend class _context;
@@ -359,9 +537,24 @@ expr range(int min, int max);
 
 expr larger(size_t value);
 
-/** creates an expression which increments the line counter
-	and resets the column counter when the given expression
-	is parsed successfully; used for newline characters.
+/** creates an expression which skips the input up to one of the given
+	ASCII characters or the end of input, like *(not_(set(s)) >> any()).
+	Parsing never fails.
+	@param s null-terminated string with the ASCII characters to stop at.
+	@return an expression which skips the input.
+*/
+expr scan_until(const char* s);
+
+/** creates an expression which skips a run of the given ASCII
+	characters, like *set(s). Parsing never fails.
+	@param s null-terminated string with the ASCII characters to skip.
+	@return an expression which skips the input.
+*/
+expr scan_while(const char* s);
+
+/** creates an expression which marks the newline characters of a grammar.
+	The lines of the positions are counted from the '\n' characters
+	of the input, so the expression parses the same as the given one.
 	@param e expression to wrap into a newline parser.
 	@return an expression that handles newlines.
 */
@@ -397,33 +590,63 @@ expr true_();
  */
 expr false_();
 
+/** parsing succeeds without consuming any input, and the running rule
+	can no longer backtrack into the alternatives, loops, optionals or
+	predicates enclosing the commit; if the rest of them fails, the rule
+	fails. The alternatives of the calling rules are still tried, and a
+	rule with a commit is never inlined into the rules calling it.
+ */
+expr commit_();
+
 /** parse with target expression and let user handle result.
  */
 expr user(const expr& e, const user_handler& handler);
 
+/** rewrites the expressions of the rules reached from the given rules
+	to parse the same input with fewer expressions: nested sequences and
+	choices are flattened, adjacent characters and strings of a sequence
+	are matched as one string, adjacent single character alternatives as
+	one set, and a literal starting adjacent alternatives is parsed once
+	before them. The rules which can reach themselves are found here too,
+	so the parsing threads only read them. It has to be called before any
+	of the rules is parsed.
+	@param rules rules.
+	@return the number of expressions removed.
+*/
+size_t optimize(const std::vector<rule*>& rules);
+
+/** checks if the rule can reach a user handler, the result of a rule
+	reaching none depends only on the input, so it can be memoized.
+	@param r rule.
+	@return true if a user handler can be reached, or the rule has no expression.
+*/
+bool reaches_user(rule& r);
+
 /** parses the given input.
-	The parse procedures of each rule parsed are executed
-	before this function returns, if parsing succeeds.
+	The parse procedures of the rules are executed as the rules match,
+	their results left on the stack are those of the successful parse.
 	@param i input.
 	@param g root rule of grammar.
 	@param el list of errors.
-	@param st ast object stack.
-	@param ud user data, passed to the parse procedures.
+	@param st stack of the results, passed to the parse procedures.
+	@param ud user data, passed to the user handlers.
+	@param opt optional parsing features.
 	@return true on parsing success, false on failure.
 */
-bool parse(input& i, rule& g, error_list& el, void* st, void* ud);
+bool parse(input& i, rule& g, error_list& el, parse_stack* st, void* ud, const parse_options& opt = {});
 
 /** check if the start part of given input matches grammar.
-	The parse procedures of each rule parsed are executed
-	before this function returns, if parsing succeeds.
+	The parse procedures of the rules are executed as the rules match,
+	their results left on the stack are those of the successful parse.
 	@param i input.
 	@param g root rule of grammar.
 	@param el list of errors.
-	@param st ast object stack.
-	@param ud user data, passed to the parse procedures.
+	@param st stack of the results, passed to the parse procedures.
+	@param ud user data, passed to the user handlers.
+	@param opt optional parsing features.
 	@return true on parsing success, false on failure.
 */
-bool start_with(input& i, rule& g, error_list& el, void* st, void* ud);
+bool start_with(input& i, rule& g, error_list& el, parse_stack* st, void* ud, const parse_options& opt = {});
 
 /** output the specific input range to the specific stream.
 	@param stream stream.
@@ -9,6 +9,7 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 #include "yuescript/yue_ast.h"
 
 #include <sstream>
+#include <utility>
 
 namespace parserlib {
 using namespace std::string_view_literals;
@@ -30,13 +31,28 @@ std::string YueFormat::ind() const {
 }
 
 std::string YueFormat::convert(const ast_node* node) {
-	return converter.to_bytes(std::wstring(node->m_begin.m_it, node->m_end.m_it));
+	return std::string(node->m_begin.m_it, node->m_end.m_it);
 }
 
 std::string YueFormat::toString(ast_node* node) {
 	return node->to_string(this);
 }
 
+template <int Id>
+static ast_node* new_ast_of() {
+	return new typename ast_type<Id>::node_type;
+}
+
+template <int... Ids>
+static ast_node* new_ast_of(int id, std::integer_sequence<int, Ids...>) {
+	static ast_node* (*const creators[])() = {&new_ast_of<Ids + 1>...};
+	return id > 0 && id <= static_cast<int>(sizeof...(Ids)) ? creators[id - 1]() : nullptr;
+}
+
+ast_node* new_ast(int id) {
+	return new_ast_of(id, std::make_integer_sequence<int, ast_type_count>{});
+}
+
 typedef std::list<std::string> str_list;
 
 static std::string join(const str_list& items, std::string_view sep = {}) {
@@ -15,12 +15,16 @@ namespace parserlib {
 template <class T>
 std::string_view ast_name() { return {}; }
 
+template <int Id>
+struct ast_type;
+
 #define AST_LEAF(type) \
 	COUNTER_INC; \
 	namespace yue { \
 	class type##_t : public ast_node { \
 	public: \
-		virtual int get_id() const override { return COUNTER_READ; } \
+		type##_t() \
+			: ast_node(COUNTER_READ) { } \
 		virtual std::string to_string(void*) const override; \
 		virtual const std::string_view get_name() const override { return #type ""sv; }
 
@@ -29,23 +33,30 @@ std::string_view ast_name() { return {}; }
 	namespace yue { \
 	class type##_t : public ast_container { \
 	public: \
-		virtual int get_id() const override { return COUNTER_READ; } \
+		type##_t() \
+			: ast_container(COUNTER_READ) { } \
 		virtual std::string to_string(void*) const override; \
 		virtual const std::string_view get_name() const override { return #type ""sv; }
 
 #define AST_MEMBER(type, ...) \
-	type##_t() { \
-		add_members({__VA_ARGS__}); \
+	virtual const ast_member_table& members() const override { \
+		static const ast_member_table table = make_members(this, {__VA_ARGS__}); \
+		return table; \
 	}
 
 #define AST_END(type) \
 	} \
 	; \
 	} \
+	static_assert(alignof(yue::type##_t) <= alignof(ast_node), "AST node over aligned"); \
 	template <> \
 	constexpr int id<yue::type##_t>() { return COUNTER_READ; } \
 	template <> \
-	constexpr std::string_view ast_name<yue::type##_t>() { return #type ""sv; }
+	constexpr std::string_view ast_name<yue::type##_t>() { return #type ""sv; } \
+	template <> \
+	struct ast_type<COUNTER_READ> { \
+		typedef yue::type##_t node_type; \
+	};
 
 // clang-format off
 
@@ -922,13 +933,21 @@ AST_END(File)
 
 // clang-format on
 
+/// count of the AST node types, their ids go from 1 to the count
+constexpr int ast_type_count = COUNTER_READ;
+
+/** creates an empty AST node.
+	@param id type id of the node.
+	@return the node, or null for an unknown id.
+*/
+ast_node* new_ast(int id);
+
 struct YueFormat {
 	int indent = 0;
 	bool spaceOverTab = false;
 	int tabSpaces = 4;
 	std::string toString(ast_node* node);
 
-	Converter converter{};
 	void pushScope();
 	void popScope();
 	std::string convert(const ast_node* node);
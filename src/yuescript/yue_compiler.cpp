@@ -7,6 +7,7 @@ The above copyright notice and this permission notice shall be included in all c
 THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.*/
 
 #include <chrono>
+#include <deque>
 #include <memory>
 #include <optional>
 #include <set>
@@ -94,6 +95,7 @@ CompileInfo::CompileInfo(
 	std::optional<Error>&& error,
 	std::unique_ptr<GlobalVars>&& globals,
 	std::unique_ptr<Options>&& options,
+	std::unique_ptr<RuleProfiles>&& ruleProfiles,
 	double parseTime,
 	double compileTime,
 	bool usedVar)
@@ -101,6 +103,7 @@ CompileInfo::CompileInfo(
 	, error(std::move(error))
 	, globals(std::move(globals))
 	, options(std::move(options))
+	, ruleProfiles(std::move(ruleProfiles))
 	, parseTime(parseTime)
 	, compileTime(compileTime)
 	, usedVar(usedVar) { }
@@ -110,6 +113,7 @@ CompileInfo::CompileInfo(CompileInfo&& other)
 	, error(std::move(other.error))
 	, globals(std::move(other.globals))
 	, options(std::move(other.options))
+	, ruleProfiles(std::move(other.ruleProfiles))
 	, parseTime(other.parseTime)
 	, compileTime(other.compileTime) { }
 
@@ -118,6 +122,7 @@ void CompileInfo::operator=(CompileInfo&& other) {
 	error = std::move(other.error);
 	globals = std::move(other.globals);
 	options = std::move(other.options);
+	ruleProfiles = std::move(other.ruleProfiles);
 	parseTime = other.parseTime;
 	compileTime = other.compileTime;
 }
@@ -160,21 +165,42 @@ public:
 #endif // YUE_NO_MACRO
 		double parseTime = 0.0;
 		double compileTime = 0.0;
+		ParseOptions parseOptions;
+		parseOptions.profileRules = config.profilingRules;
+		parseOptions.threads = config.parseThreads;
+		parseOptions.budget = config.parseBudget;
 		if (config.profiling) {
 			auto start = std::chrono::high_resolution_clock::now();
-			_info = _parser.parse<File_t>(codes);
+			_info = _parser.parse<File_t>(codes, parseOptions);
 			auto stop = std::chrono::high_resolution_clock::now();
 			std::chrono::duration<double> diff = stop - start;
 			parseTime = diff.count();
 		} else {
-			_info = _parser.parse<File_t>(codes);
+			_info = _parser.parse<File_t>(codes, parseOptions);
 		}
 		std::unique_ptr<GlobalVars> globals;
 		std::unique_ptr<Options> options;
 		if (!config.options.empty()) {
 			options = std::make_unique<Options>(config.options);
 		}
+		std::unique_ptr<RuleProfiles> ruleProfiles;
+		if (config.profilingRules) {
+			ruleProfiles = std::make_unique<RuleProfiles>();
+			for (const auto& item : _info.ruleProfile) {
+				ruleProfiles->push_back({item.name ? item.name : "",
+					item.calls,
+					item.successes,
+					item.failures,
+					item.consumed,
+					item.backtracked,
+					item.memo_hits,
+					item.memo_misses,
+					item.inclusive_time,
+					item.exclusive_time});
+			}
+		}
 		DEFER(clear());
+		ast_arena::scope arenaScope(_info.arena.get());
 		if (!_info.error) {
 			try {
 				auto block = _info.node.to<File_t>()->block.get();
@@ -289,7 +315,7 @@ public:
 				}
 #endif // YUE_NO_MACRO
 				bool usedVar = _varArgs.top().usedVar;
-				return {std::move(out.back()), std::nullopt, std::move(globals), std::move(options), parseTime, compileTime, usedVar};
+				return {std::move(out.back()), std::nullopt, std::move(globals), std::move(options), std::move(ruleProfiles), parseTime, compileTime, usedVar};
 			} catch (const CompileError& error) {
 				auto displayMessage = _info.errorMessage(error.what(), error.line, error.col, _config.lineOffset);
 				return {
@@ -301,6 +327,7 @@ public:
 						displayMessage},
 					std::move(globals),
 					std::move(options),
+					std::move(ruleProfiles),
 					parseTime, compileTime, false};
 			}
 		} else {
@@ -315,6 +342,7 @@ public:
 						""},
 					std::move(globals),
 					std::move(options),
+					std::move(ruleProfiles),
 					parseTime, compileTime, false};
 			}
 			auto displayMessage = _info.errorMessage(error.msg, error.line, error.col, _config.lineOffset);
@@ -327,6 +355,7 @@ public:
 					displayMessage},
 				std::move(globals),
 				std::move(options),
+				std::move(ruleProfiles),
 				parseTime, compileTime, false};
 		}
 	}
@@ -334,6 +363,8 @@ public:
 	void clear() {
 		_indentOffset = 0;
 		_scopes.clear();
+		_symbolIds.clear();
+		_symbols.clear();
 		_codeCache.clear();
 		_buf.str("");
 		_buf.clear();
@@ -435,11 +466,15 @@ private:
 #ifndef YUE_NO_MACRO
 		bool macroScope = false;
 #endif
-		std::unique_ptr<std::unordered_map<std::string, VarType>> vars;
-		std::unique_ptr<std::unordered_set<std::string>> allows;
-		std::unique_ptr<std::unordered_set<std::string>> globals;
+		std::unique_ptr<std::unordered_map<uint32_t, VarType>> vars;
+		std::unique_ptr<std::unordered_set<uint32_t>> allows;
+		std::unique_ptr<std::unordered_set<uint32_t>> globals;
 	};
 	std::list<Scope> _scopes;
+	// names of the variables met by the scopes, interned so that a lookup
+	// hashes the name once and the scopes compare symbol ids
+	mutable std::deque<std::string> _symbols;
+	mutable std::unordered_map<std::string_view, uint32_t> _symbolIds;
 	static const std::string Empty;
 
 	enum class MemType {
@@ -499,7 +534,7 @@ private:
 
 	void pushScope() {
 		_scopes.emplace_back();
-		_scopes.back().vars = std::make_unique<std::unordered_map<std::string, VarType>>();
+		_scopes.back().vars = std::make_unique<std::unordered_map<uint32_t, VarType>>();
 	}
 
 	void popScope() {
@@ -511,6 +546,21 @@ private:
 		_scopes.pop_back();
 	}
 
+	uint32_t symbolOf(std::string_view name) const {
+		auto it = _symbolIds.find(name);
+		if (it != _symbolIds.end()) return it->second;
+		auto symbol = static_cast<uint32_t>(_symbols.size());
+		_symbolIds.emplace(_symbols.emplace_back(name), symbol);
+		return symbol;
+	}
+
+	// a name without a symbol was never added to a scope
+	std::optional<uint32_t> findSymbol(std::string_view name) const {
+		auto it = _symbolIds.find(name);
+		if (it != _symbolIds.end()) return it->second;
+		return std::nullopt;
+	}
+
 	bool isDefined(const std::string& name) const {
 		bool isDefined = false;
 		int mode = int(std::isupper(name[0]) ? GlobalMode::Capital : GlobalMode::Any);
@@ -518,20 +568,22 @@ private:
 		if (int(current.mode) >= mode) {
 			if (!current.globals) {
 				isDefined = true;
-				current.vars->insert_or_assign(name, VarType::Global);
+				current.vars->insert_or_assign(symbolOf(name), VarType::Global);
 			}
 		}
+		auto symbol = findSymbol(name);
+		if (!symbol) return isDefined;
 		decltype(_scopes.back().allows.get()) allows = nullptr;
 		for (auto it = _scopes.rbegin(); it != _scopes.rend(); ++it) {
 			if (it->allows) allows = it->allows.get();
 		}
 		bool checkShadowScopeOnly = false;
 		if (allows) {
-			checkShadowScopeOnly = allows->find(name) == allows->end();
+			checkShadowScopeOnly = allows->find(*symbol) == allows->end();
 		}
 		for (auto it = _scopes.rbegin(); it != _scopes.rend(); ++it) {
 			auto vars = it->vars.get();
-			if (vars->find(name) != vars->end()) {
+			if (vars->find(*symbol) != vars->end()) {
 				isDefined = true;
 				break;
 			}
@@ -542,9 +594,11 @@ private:
 
 	bool isSolidDefined(const std::string& name) const {
 		bool defined = false;
+		auto symbol = findSymbol(name);
+		if (!symbol) return defined;
 		for (auto it = _scopes.rbegin(); it != _scopes.rend(); ++it) {
 			auto vars = it->vars.get();
-			auto vit = vars->find(name);
+			auto vit = vars->find(*symbol);
 			if (vit != vars->end()) {
 				defined = true;
 				break;
@@ -555,9 +609,11 @@ private:
 
 	bool isLocal(const std::string& name) const {
 		bool local = false;
+		auto symbol = findSymbol(name);
+		if (!symbol) return local;
 		for (auto it = _scopes.rbegin(); it != _scopes.rend(); ++it) {
 			auto vars = it->vars.get();
-			auto vit = vars->find(name);
+			auto vit = vars->find(*symbol);
 			if (vit != vars->end() && vit->second != VarType::Global) {
 				local = true;
 				break;
@@ -568,9 +624,11 @@ private:
 
 	bool isDeclaredAsGlobal(const std::string& name) const {
 		bool global = false;
+		auto symbol = findSymbol(name);
+		if (!symbol) return global;
 		for (auto it = _scopes.rbegin(); it != _scopes.rend(); ++it) {
 			auto vars = it->vars.get();
-			auto vit = vars->find(name);
+			auto vit = vars->find(*symbol);
 			if (vit != vars->end() && vit->second == VarType::Global) {
 				global = true;
 				break;
@@ -581,17 +639,19 @@ private:
 
 	bool isConst(const std::string& name) const {
 		bool isConst = false;
+		auto symbol = findSymbol(name);
+		if (!symbol) return isConst;
 		decltype(_scopes.back().allows.get()) allows = nullptr;
 		for (auto it = _scopes.rbegin(); it != _scopes.rend(); ++it) {
 			if (it->allows) allows = it->allows.get();
 		}
 		bool checkShadowScopeOnly = false;
 		if (allows) {
-			checkShadowScopeOnly = allows->find(name) == allows->end();
+			checkShadowScopeOnly = allows->find(*symbol) == allows->end();
 		}
 		for (auto it = _scopes.rbegin(); it != _scopes.rend(); ++it) {
 			auto vars = it->vars.get();
-			auto vit = vars->find(name);
+			auto vit = vars->find(*symbol);
 			if (vit != vars->end()) {
 				isConst = (vit->second == VarType::Const);
 				break;
@@ -876,12 +936,12 @@ private:
 
 	void markVarConst(const std::string& name) {
 		auto& scope = _scopes.back();
-		scope.vars->insert_or_assign(name, VarType::Const);
+		scope.vars->insert_or_assign(symbolOf(name), VarType::Const);
 	}
 
 	void markVarShadowed() {
 		auto& scope = _scopes.back();
-		scope.allows = std::make_unique<std::unordered_set<std::string>>();
+		scope.allows = std::make_unique<std::unordered_set<uint32_t>>();
 	}
 
 	void markVarsGlobal(GlobalMode mode) {
@@ -893,20 +953,21 @@ private:
 		if (isLocal(name)) throw CompileError("can not declare a local variable to be global"sv, x);
 		auto& scope = _scopes.back();
 		if (!scope.globals) {
-			scope.globals = std::make_unique<std::unordered_set<std::string>>();
+			scope.globals = std::make_unique<std::unordered_set<uint32_t>>();
 		}
-		scope.globals->insert(name);
-		scope.vars->insert_or_assign(name, VarType::Global);
+		auto symbol = symbolOf(name);
+		scope.globals->insert(symbol);
+		scope.vars->insert_or_assign(symbol, VarType::Global);
 	}
 
 	void addToAllowList(const std::string& name) {
 		auto& scope = _scopes.back();
-		scope.allows->insert(name);
+		scope.allows->insert(symbolOf(name));
 	}
 
 	void forceAddToScope(const std::string& name) {
 		auto& scope = _scopes.back();
-		scope.vars->insert_or_assign(name, VarType::Local);
+		scope.vars->insert_or_assign(symbolOf(name), VarType::Local);
 	}
 
 	Scope& currentScope() {
@@ -917,7 +978,7 @@ private:
 		bool defined = isDefined(name);
 		if (!defined) {
 			auto& scope = currentScope();
-			scope.vars->insert_or_assign(name, VarType::Local);
+			scope.vars->insert_or_assign(symbolOf(name), VarType::Local);
 		}
 		return !defined;
 	}
@@ -1349,9 +1410,13 @@ private:
 
 	std::string unicodeVariableFrom(UnicodeName_t* uname) {
 		std::ostringstream buf;
-		for (auto it = uname->m_begin.m_it; it != uname->m_end.m_it; ++it) {
-			auto ch = *it;
-			if (ch > 255) {
+		for (auto it = uname->m_begin.m_it; it != uname->m_end.m_it;) {
+			auto ch = utf8_next(it, uname->m_end.m_it);
+			if (ch > 0xFFFF) {
+				ch -= 0x10000;
+				buf << "_u"sv << std::hex << static_cast<int>(0xD800 + (ch >> 10));
+				buf << "_u"sv << std::hex << static_cast<int>(0xDC00 + (ch & 0x3FF));
+			} else if (ch > 255) {
 				buf << "_u"sv << std::hex << static_cast<int>(ch);
 			} else {
 				buf << static_cast<char>(ch);
@@ -2113,7 +2178,7 @@ private:
 			newAssign->values.dup(assign->values);
 			auto i = exprs.begin();
 			auto j = values.begin();
-			auto je = --values.end();
+			auto je = std::prev(values.end());
 			while (j != je) {
 				++i;
 				++j;
@@ -3039,7 +3104,7 @@ private:
 		ast_ptr<false, Exp_t> nil;
 		if (values.size() < size) {
 			nil = toAst<Exp_t>("nil"sv, x);
-			while (values.size() < size) values.emplace_back(nil);
+			while (values.size() < size) values.push_back(nil);
 		}
 		using iter = node_container::iterator;
 		std::vector<std::pair<iter, iter>> assignPairs;
@@ -4092,7 +4157,7 @@ private:
 				for (const auto& scope : _scopes) {
 					if (scope.vars) {
 						for (const auto& var : *scope.vars) {
-							globals.push_back(var.first);
+							globals.push_back(_symbols[var.first]);
 						}
 					}
 				}
@@ -5833,7 +5898,7 @@ private:
 					}
 					break;
 			}
-			auto end = --chainList.end();
+			auto end = std::prev(chainList.end());
 			for (auto it = chainList.begin(); it != end; ++it) {
 				baseChain->items.push_back(*it);
 			}
@@ -6363,7 +6428,7 @@ private:
 		const node_container* args = nullptr;
 		{
 			if (chainList.size() > 1) {
-				auto item = *(++chainList.begin());
+				auto item = *std::next(chainList.begin());
 				if (auto invoke = ast_cast<Invoke_t>(item)) {
 					args = &invoke->args.objects();
 				} else if (auto invoke = ast_cast<InvokeArgs_t>(item)) {
@@ -8871,7 +8936,7 @@ private:
 			}
 			for (const auto& classVar : classConstVars) {
 				auto& scope = _scopes.back();
-				scope.vars->insert_or_assign(classVar, VarType::Local);
+				scope.vars->insert_or_assign(symbolOf(classVar), VarType::Local);
 			}
 			for (auto stmt_ : block->statements.objects()) {
 				transformStatement(static_cast<Statement_t*>(stmt_), statements);
@@ -31,9 +31,12 @@ struct YueConfig {
 	bool reserveLineNumber = true;
 	bool useSpaceOverTab = false;
 	bool reserveComment = false;
+	int parseThreads = 0;
+	size_t parseBudget = 0;
 	// internal options
 	bool exporting = false;
 	bool profiling = false;
+	bool profilingRules = false;
 	int lineOffset = 0;
 	std::string module;
 	Options options;
@@ -55,6 +58,21 @@ struct GlobalVar {
 
 using GlobalVars = std::vector<GlobalVar>;
 
+struct RuleProfile {
+	std::string name;
+	size_t calls;
+	size_t successes;
+	size_t failures;
+	size_t consumed;
+	size_t backtracked;
+	size_t memoHits;
+	size_t memoMisses;
+	double inclusiveTime;
+	double exclusiveTime;
+};
+
+using RuleProfiles = std::vector<RuleProfile>;
+
 struct CompileInfo {
 	std::string codes;
 	struct Error {
@@ -66,6 +84,7 @@ struct CompileInfo {
 	std::optional<Error> error;
 	std::unique_ptr<GlobalVars> globals;
 	std::unique_ptr<Options> options;
+	std::unique_ptr<RuleProfiles> ruleProfiles;
 	double parseTime;
 	double compileTime;
 	bool usedVar;
@@ -76,6 +95,7 @@ struct CompileInfo {
 		std::optional<Error>&& error,
 		std::unique_ptr<GlobalVars>&& globals,
 		std::unique_ptr<Options>&& options,
+		std::unique_ptr<RuleProfiles>&& ruleProfiles,
 		double parseTime,
 		double compileTime,
 		bool usedVar);
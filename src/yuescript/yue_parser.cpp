@@ -8,6 +8,21 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 
 #include "yuescript/yue_parser.h"
 
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <iterator>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#endif // _WIN32
+
 namespace pl = parserlib;
 
 namespace yue {
@@ -43,14 +58,14 @@ public:
 
 // clang-format off
 YueParser::YueParser() {
-	plain_space = *set(" \t");
+	plain_space = scan_while(" \t");
 	line_break = nl(-expr('\r') >> '\n');
 	any_char = line_break | any();
 	stop = line_break | eof();
-	comment = "--" >> *(not_(set("\r\n")) >> any_char) >> and_(stop);
+	comment = "--" >> scan_until("\r\n") >> and_(stop);
 	multi_line_open = "--[[";
 	multi_line_close = "]]";
-	multi_line_content = *(not_(multi_line_close) >> any_char);
+	multi_line_content = scan_until("]") >> *(not_(multi_line_close) >> any_char >> scan_until("]"));
 	multi_line_comment = multi_line_open >> multi_line_content >> multi_line_close;
 	escape_new_line = '\\' >> *(set(" \t") | multi_line_comment) >> -comment >> line_break;
 	space_one = set(" \t") | and_(set("-\\")) >> (multi_line_comment | escape_new_line);
@@ -174,7 +189,7 @@ YueParser::YueParser() {
 	Variable = pl::user(Name | UnicodeName, [](const item_t& item) {
 		State* st = reinterpret_cast<State*>(item.user_data);
 		for (auto it = item.begin->m_it; it != item.end->m_it; ++it) {
-			if (*it > 255) {
+			if (static_cast<unsigned char>(*it) > 127) {
 				st->buffer.clear();
 				return true;
 			}
@@ -184,6 +199,7 @@ YueParser::YueParser() {
 		if (isValid) {
 			if (st->buffer[0] == '_') {
 				st->usedNames.insert(st->buffer);
+				st->usedNameLines.emplace_back(item.begin->m_line, st->buffer);
 			}
 		}
 		st->buffer.clear();
@@ -193,7 +209,7 @@ YueParser::YueParser() {
 	LabelName = pl::user(UnicodeName, [](const item_t& item) {
 		State* st = reinterpret_cast<State*>(item.user_data);
 		for (auto it = item.begin->m_it; it != item.end->m_it; ++it) {
-			if (*it > 255) {
+			if (static_cast<unsigned char>(*it) > 127) {
 				st->buffer.clear();
 				return true;
 			}
@@ -338,7 +354,7 @@ YueParser::YueParser() {
 
 	ImportAs = ImportLiteral >> -(space >> key("as") >> space >> (ImportTabLit | Variable | ImportAllMacro));
 
-	Import = key("import") >> space >> (ImportAs | ImportFrom) | FromImport;
+	Import = key("import") >> commit_() >> space >> (ImportAs | ImportFrom) | FromImport;
 
 	Label = "::" >> LabelName >> "::";
 
@@ -368,11 +384,11 @@ YueParser::YueParser() {
 	);
 	Switch = key("switch") >> space >> Exp >>
 		space >> Seperator >> (
+			+space_break >> commit_() >> advance_match >> space >> SwitchCase >> switch_block >> pop_indent |
 			SwitchCase >> space >> (
 				switch_block |
 				*(space >> SwitchCase) >> -(space >> switch_else)
-			) |
-			+space_break >> advance_match >> space >> SwitchCase >> switch_block >> pop_indent
+			)
 		);
 
 	Assignment = -(',' >> space >> ExpList >> space) >> (':' >> Assign | and_('=') >> if_assignment_syntax_error);
@@ -600,11 +616,11 @@ YueParser::YueParser() {
 	Value = inc_exp_level >> ensure(SimpleValue | SimpleTable | ChainValue | String, dec_exp_level);
 
 	single_string_inner = '\\' >> set("'\\") | not_('\'') >> any_char;
-	SingleString = '\'' >> *single_string_inner >> '\'';
+	SingleString = '\'' >> scan_until("'\\") >> *(single_string_inner >> scan_until("'\\")) >> '\'';
 
 	interp = "#{" >> space >> (Exp >> space >> '}' | invalid_interpolation_error);
 	double_string_plain = '\\' >> set("\"\\#") | not_('"') >> any_char;
-	DoubleStringInner = +(not_("#{") >> double_string_plain);
+	DoubleStringInner = +(not_("#{") >> double_string_plain >> scan_until("\"\\#"));
 	DoubleStringContent = DoubleStringInner | interp;
 	DoubleString = '"' >> Seperator >> *DoubleStringContent >> '"';
 	String = DoubleString | SingleString | LuaString;
@@ -625,7 +641,7 @@ YueParser::YueParser() {
 		return st->stringOpen == count;
 	});
 
-	LuaStringContent = *(not_(LuaStringClose) >> any_char);
+	LuaStringContent = scan_until("]") >> *(not_(LuaStringClose) >> any_char >> scan_until("]"));
 
 	LuaString = LuaStringOpen >> -line_break >> LuaStringContent >> LuaStringClose;
 
@@ -762,7 +778,7 @@ YueParser::YueParser() {
 		st->exportCount++;
 		return true;
 	}) >> (
-		pl::user(space >> ExportDefault >> space >> Exp, [](const item_t& item) {
+		pl::user(space >> ExportDefault >> commit_() >> space >> Exp, [](const item_t& item) {
 			State* st = reinterpret_cast<State*>(item.user_data);
 			if (st->exportDefault) {
 				throw ParserError("export default has already been declared"sv, item.begin);
@@ -943,7 +959,7 @@ YueParser::YueParser() {
 	IfLine = IfType >> space >> IfCond;
 	WhileLine = WhileType >> space >> Exp;
 
-	YueLineComment = *(not_(set("\r\n")) >> any_char);
+	YueLineComment = scan_until("\r\n");
 	yue_line_comment = "--" >> YueLineComment >> and_(stop);
 	MultilineCommentInner = multi_line_content;
 	YueMultilineComment = multi_line_open >> MultilineCommentInner >> multi_line_close;
@@ -1000,27 +1016,52 @@ YueParser::YueParser() {
 	shebang = "#!" >> *(not_(stop) >> any_char);
 	BlockEnd = Block >> white >> stop;
 	File = -shebang >> -Block >> white >> stop;
+
+	reparse_stop = pl::user(true_(), [](const item_t& item) {
+		State* st = reinterpret_cast<State*>(item.user_data);
+		return item.begin->m_line >= st->reparseLine;
+	});
+
+	reparse_end = pl::user(true_(), [](const item_t& item) {
+		State* st = reinterpret_cast<State*>(item.user_data);
+		return item.begin->m_line == st->reparseLine && item.begin->m_col == 1;
+	});
+
+	reparse_block = Seperator >> line >> *(+line_break >> not_(reparse_stop) >> line);
+	reparse_region = reparse_block >> (
+		*(line_break >> plain_space) >> reparse_end |
+		white >> stop >> eof() >> not_(reparse_stop)
+	);
+	reparse_head = -shebang >> reparse_region;
+
+	// the literals and names parsed again by the alternatives
+	// sharing a prefix are reused at the same position
+	String.set_token();
+	DoubleStringInner.set_token();
+	Name.set_token();
+	Num.set_token();
+
+	std::vector<rule*> roots{reparse_head.this_ptr()};
+	for (const auto& item : _rules) {
+		roots.push_back(item.second);
+	}
+	_optimizedExprCount = optimize(roots);
 }
 // clang-format on
 
 bool YueParser::startWith(std::string_view codes, rule& r) {
-	std::unique_ptr<input> converted;
 	if (codes.substr(0, 3) == "\xEF\xBB\xBF"sv) {
 		codes = codes.substr(3);
 	}
-	try {
-		if (!codes.empty()) {
-			converted = std::make_unique<input>(_converter.from_bytes(&codes.front(), &codes.back() + 1));
-		} else {
-			converted = std::make_unique<input>();
-		}
-	} catch (const std::range_error&) {
+	if (!utf8_valid(codes)) {
 		return false;
 	}
+	auto converted = std::make_unique<input>(codes);
 	error_list errors;
 	try {
 		State state;
-		return ::yue::start_with(*converted, r, errors, &state);
+		ast_ptr<false, ast_node> node(::yue::start_with(*converted, r, errors, &state));
+		return node.get() != nullptr;
 	} catch (const ParserError&) {
 		return false;
 	} catch (const std::logic_error&) {
@@ -1029,25 +1070,35 @@ bool YueParser::startWith(std::string_view codes, rule& r) {
 	return true;
 }
 
-ParseInfo YueParser::parse(std::string_view codes, rule& r) {
+ParseInfo YueParser::parse(std::string_view codes, rule& r, const ParseOptions& options) {
 	ParseInfo res;
 	if (codes.substr(0, 3) == "\xEF\xBB\xBF"sv) {
 		codes = codes.substr(3);
 	}
-	try {
-		if (!codes.empty()) {
-			res.codes = std::make_unique<input>(_converter.from_bytes(&codes.front(), &codes.back() + 1));
-		} else {
-			res.codes = std::make_unique<input>();
-		}
-	} catch (const std::range_error&) {
+	if (!utf8_valid(codes)) {
 		res.error = {"invalid text encoding"s, 1, 1};
 		return res;
 	}
+	res.codes = std::make_unique<input>(codes);
+	res.arena = ast_arena::make();
+	ast_arena::scope arenaScope(res.arena.get());
+	// the budget counts the work of one serial parse, which the chunks
+	// parsed in parallel and a serial parse after them would exceed
+	if (r.this_ptr() == File.this_ptr() && options.threads > 1 && !options.profileRules && !options.budget && parseInParallel(res, options)) {
+		return res;
+	}
 	error_list errors;
 	try {
 		State state;
-		res.node.set(::yue::parse(*(res.codes), r, errors, &state));
+		parse_options opt;
+		opt.memo_all = options.memoAll;
+		opt.tokens = options.reuseTokens;
+		opt.budget = options.budget;
+		opt.memo = &res.memoStats;
+		if (options.profileRules) {
+			opt.profile = &res.ruleProfile;
+		}
+		res.node.set(::yue::parse(*(res.codes), r, errors, &state, opt));
 		if (state.exportCount > 0) {
 			int index = 0;
 			std::string moduleName;
@@ -1063,6 +1114,7 @@ ParseInfo YueParser::parse(std::string_view codes, rule& r) {
 			res.exportMetatable = !state.exportMetatable && state.exportMetamethod;
 		}
 		res.usedNames = std::move(state.usedNames);
+		res.usedNameLines = std::move(state.usedNameLines);
 	} catch (const ParserError& err) {
 		res.error = {err.what(), err.line, err.col};
 		return res;
@@ -1079,19 +1131,572 @@ ParseInfo YueParser::parse(std::string_view codes, rule& r) {
 			case ERROR_TYPE::ERROR_INVALID_EOF:
 				res.error = {"invalid EOF"s, err.m_begin.m_line, err.m_begin.m_col};
 				break;
+			case ERROR_TYPE::ERROR_BUDGET_EXCEEDED:
+				res.error = {"parse budget exceeded"s, err.m_begin.m_line, err.m_begin.m_col};
+				break;
+			case ERROR_TYPE::ERROR_INPUT_TOO_LARGE:
+				res.error = {"input too large"s, err.m_begin.m_line, err.m_begin.m_col};
+				break;
 		}
 	}
 	return res;
 }
 
-ParseInfo YueParser::parse(std::string_view astName, std::string_view codes) {
+// find the lines that may start a top-level statement, the lines starting with
+// a name at the first column outside of brackets, strings and comments, and
+// not right after a comment line which would belong to the statement
+static std::vector<size_t> findStatementLines(std::string_view codes, size_t spacing) {
+	std::vector<size_t> lines;
+	// open brackets and strings, '#' is an interpolation in a '"' string
+	std::vector<char> frames;
+	auto longBracket = [&](size_t i) {
+		size_t k = i + 1;
+		while (k < codes.size() && codes[k] == '=') k++;
+		return k < codes.size() && codes[k] == '[' ? static_cast<int>(k - i - 1) : -1;
+	};
+	auto skipLongBracket = [&](size_t i, int level) {
+		auto close = ']' + std::string(level, '=') + ']';
+		auto end = codes.find(close, i + level + 2);
+		return end == std::string_view::npos ? codes.size() : end + close.size();
+	};
+	size_t last = 0;
+	bool lineCode = false, lineComment = false, prevComment = false;
+	size_t i = 0;
+	while (i < codes.size()) {
+		char ch = codes[i];
+		if (!frames.empty() && (frames.back() == '"' || frames.back() == '\'')) {
+			if (ch == '\\') {
+				i += 2;
+			} else if (ch == frames.back()) {
+				frames.pop_back();
+				i++;
+			} else if (ch == '#' && frames.back() == '"' && i + 1 < codes.size() && codes[i + 1] == '{') {
+				frames.push_back('#');
+				i += 2;
+			} else {
+				i++;
+			}
+			continue;
+		}
+		switch (ch) {
+			case '\n': {
+				prevComment = lineComment && !lineCode;
+				lineCode = lineComment = false;
+				i++;
+				if (!frames.empty() || prevComment || i - last < spacing) break;
+				size_t k = i;
+				while (k < codes.size() && (std::isalnum(static_cast<unsigned char>(codes[k])) || codes[k] == '_')) k++;
+				auto word = codes.substr(i, k - i);
+				if (!word.empty() && !std::isdigit(static_cast<unsigned char>(word.front()))
+					&& word != "else"sv && word != "elseif"sv && word != "when"sv
+					&& word != "catch"sv && word != "until"sv && word != "then"sv) {
+					lines.push_back(i);
+					last = i;
+				}
+				break;
+			}
+			case '-':
+				if (i + 1 < codes.size() && codes[i + 1] == '-') {
+					lineComment = lineComment || !lineCode;
+					if (codes.substr(i, 4) == "--[["sv) {
+						i = skipLongBracket(i + 2, 0);
+					} else {
+						i = codes.find('\n', i);
+						if (i == std::string_view::npos) i = codes.size();
+					}
+					break;
+				}
+				lineCode = true;
+				i++;
+				break;
+			case '[': {
+				lineCode = true;
+				int level = longBracket(i);
+				if (level >= 0) {
+					i = skipLongBracket(i, level);
+				} else {
+					frames.push_back(ch);
+					i++;
+				}
+				break;
+			}
+			case '(':
+			case '{':
+			case '"':
+			case '\'':
+				lineCode = true;
+				frames.push_back(ch);
+				i++;
+				break;
+			case ')':
+			case ']':
+			case '}':
+				lineCode = true;
+				if (!frames.empty()) frames.pop_back();
+				i++;
+				break;
+			case ' ':
+			case '\t':
+			case '\r':
+				i++;
+				break;
+			default:
+				lineCode = true;
+				i++;
+				break;
+		}
+	}
+	return lines;
+}
+
+bool YueParser::parseInParallel(ParseInfo& res, const ParseOptions& options) {
+	// chunks smaller than this are not worth a thread
+	const size_t minChunkSize = 256 * 1024;
+	auto& codes = *res.codes;
+	size_t chunkCount = std::min(static_cast<size_t>(options.threads) * 2, codes.size() / minChunkSize);
+	if (chunkCount < 2) {
+		return false;
+	}
+	std::vector<size_t> starts{0};
+	for (size_t line : findStatementLines(codes, codes.size() / chunkCount)) {
+		starts.push_back(line);
+	}
+	if (starts.size() < 2) {
+		return false;
+	}
+	struct Chunk {
+		size_t start;
+		int stopLine;
+		State state;
+		ast_ptr<false, Block_t> block;
+		memo_stats memo;
+	};
+	std::vector<Chunk> chunks(starts.size());
+	int line = 1;
+	for (size_t i = 0; i < chunks.size(); i++) {
+		chunks[i].start = starts[i];
+		if (i > 0) {
+			line += static_cast<int>(std::count(codes.begin() + starts[i - 1], codes.begin() + starts[i], '\n'));
+			chunks[i - 1].stopLine = line;
+		}
+	}
+	chunks.back().stopLine = std::numeric_limits<int>::max();
+
+	// each chunk has to end right at the line the next one starts with,
+	// otherwise a guessed line was no statement and the file is parsed serially
+	std::atomic<size_t> next{0};
+	std::atomic<bool> failed{false};
+	auto work = [&]() {
+		for (size_t i; !failed && (i = next++) < chunks.size();) {
+			auto& chunk = chunks[i];
+			chunk.state.reparseLine = chunk.stopLine;
+			// a thread allocates the nodes of a chunk in an arena of its own,
+			// which is freed with the nodes
+			auto arena = ast_arena::make();
+			ast_arena::scope arenaScope(arena.get());
+			try {
+				error_list errors;
+				parse_options opt;
+				opt.memo_all = options.memoAll;
+				opt.tokens = options.reuseTokens;
+				opt.memo = &chunk.memo;
+				opt.start = chunk.start;
+				opt.start_line = i == 0 ? 1 : chunks[i - 1].stopLine;
+				chunk.block.set(::yue::start_with(codes, i == 0 ? reparse_head : reparse_region, errors, &chunk.state, opt));
+			} catch (const std::logic_error&) {
+			}
+			if (!chunk.block || chunk.state.exportCount > 0) {
+				failed = true;
+			}
+		}
+	};
+	std::vector<std::thread> workers;
+	size_t threadCount = std::min(static_cast<size_t>(options.threads), chunks.size());
+	for (size_t i = 1; i < threadCount; i++) {
+		workers.emplace_back(work);
+	}
+	work();
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	if (failed) {
+		return false;
+	}
+
+	auto block = chunks.front().block.get();
+	for (size_t i = 1; i < chunks.size(); i++) {
+		auto& statements = chunks[i].block->statements;
+		block->statements.replace(block->statements.objects().end(), block->statements.objects().end(), statements.objects());
+		block->m_end = chunks[i].block->m_end;
+	}
+	auto file = block->new_ptr<File_t>();
+	file->m_begin.m_it = codes.begin();
+	file->m_begin.m_line = 1;
+	file->m_begin.m_col = 1;
+	file->m_end.m_it = codes.end();
+	auto lineBegin = codes.rfind('\n');
+	lineBegin = lineBegin == std::string::npos ? 0 : lineBegin + 1;
+	file->m_end.m_line = line + static_cast<int>(std::count(codes.begin() + starts.back(), codes.end(), '\n'));
+	file->m_end.m_col = 1 + static_cast<int>(std::count_if(codes.begin() + lineBegin, codes.end(), [](char ch) {
+		return (static_cast<unsigned char>(ch) & 0xC0) != 0x80;
+	}));
+	file->block.set(block);
+	for (auto& chunk : chunks) {
+		res.memoStats.hits += chunk.memo.hits;
+		res.memoStats.misses += chunk.memo.misses;
+		res.usedNames.merge(chunk.state.usedNames);
+		std::move(chunk.state.usedNameLines.begin(), chunk.state.usedNameLines.end(), std::back_inserter(res.usedNameLines));
+	}
+	res.node.set(file);
+	return true;
+}
+
+ParseInfo YueParser::parse(std::string_view astName, std::string_view codes, const ParseOptions& options) {
 	auto it = _rules.find(astName);
 	if (it != _rules.end()) {
-		return parse(codes, *it->second);
+		return parse(codes, *it->second, options);
 	}
 	return {};
 }
 
+// shift the positions of the nodes of the top-level statements in [from, to)
+static void shiftStatements(const node_container& objects, size_t from, size_t to, ptrdiff_t bytes, int lines) {
+	if (bytes == 0 && lines == 0) return;
+	for (size_t i = from; i < to; ++i) {
+		objects[i]->traverse([&](ast_node* node) {
+			for (pos* p : {&node->m_begin, &node->m_end}) {
+				p->m_it += bytes;
+				p->m_line += lines;
+			}
+			return traversal::Continue;
+		});
+	}
+}
+
+ParseInfo YueParser::reparse(ParseInfo&& info, const TextEdit& edit, const ParseOptions& options) {
+	if (!info.codes || edit.offset > info.codes->size() || edit.length > info.codes->size() - edit.offset) {
+		ParseInfo res;
+		res.error = {"invalid text edit"s, 1, 1};
+		return res;
+	}
+	size_t editEnd = edit.offset + edit.length;
+	int lineDelta = static_cast<int>(std::count(edit.text.begin(), edit.text.end(), '\n'))
+		- static_cast<int>(std::count(info.codes->begin() + edit.offset, info.codes->begin() + editEnd, '\n'));
+	ptrdiff_t byteDelta = static_cast<ptrdiff_t>(edit.text.size()) - static_cast<ptrdiff_t>(edit.length);
+
+	// the export checks depend on all the statements, so only files without
+	// exports are parsed again from the top-level statements around the edit
+	auto file = info.node.as<File_t>();
+	bool incremental = !info.error && info.moduleName.empty() && file && file->block;
+	size_t first = 0, last = 0, regionBegin = 0;
+	ast_node* nextStmt = nullptr;
+	int regionLine = 1, regionEndLine = std::numeric_limits<int>::max();
+	if (incremental) {
+		const auto& objects = file->block->statements.objects();
+		auto offsetOf = [&](size_t index) {
+			return objects[index]->m_begin.m_it - info.codes->begin();
+		};
+		auto lineOf = [&](size_t index) {
+			return objects[index]->m_begin.m_line;
+		};
+		auto countTo = [&](size_t offset) {
+			size_t low = 0, high = objects.size();
+			while (low < high) {
+				size_t mid = low + (high - low) / 2;
+				if (offsetOf(mid) <= static_cast<ptrdiff_t>(offset)) {
+					low = mid + 1;
+				} else {
+					high = mid;
+				}
+			}
+			return low;
+		};
+		size_t count = countTo(edit.offset);
+		// the statements before and after the edited ones are parsed again too,
+		// since a statement may look at the next line to end
+		first = count > 1 ? count - 2 : 0;
+		last = std::min(countTo(editEnd) + 1, objects.size());
+		auto firstStmt = count > 0 ? objects[first] : nullptr;
+		nextStmt = last < objects.size() ? objects[last] : nullptr;
+		if (!firstStmt || firstStmt->m_begin.m_col != 1 || (nextStmt && nextStmt->m_begin.m_col != 1)) {
+			incremental = false;
+		} else {
+			regionBegin = static_cast<size_t>(offsetOf(first));
+			regionLine = lineOf(first);
+			if (nextStmt) regionEndLine = lineOf(last);
+		}
+	}
+
+	// the codes are edited in place, a buffer too small is replaced by one
+	// with room for the next edits, with the nodes moved into it
+	auto& codes = info.codes;
+	size_t size = codes->size() + byteDelta;
+	if (size > codes->capacity()) {
+		auto grown = std::make_unique<input>();
+		grown->reserve(size + size / 2);
+		grown->assign(*codes);
+		if (info.node) {
+			info.node->traverse([&](ast_node* node) {
+				for (pos* p : {&node->m_begin, &node->m_end}) {
+					p->m_it = grown->begin() + (p->m_it - codes->begin());
+				}
+				return traversal::Continue;
+			});
+		}
+		codes = std::move(grown);
+	}
+	codes->replace(edit.offset, edit.length, edit.text);
+	if (incremental) {
+		// an edit may split a code point as well, so the edited lines are checked
+		auto lineBegin = edit.offset > 0 ? codes->rfind('\n', edit.offset - 1) : std::string::npos;
+		lineBegin = lineBegin == std::string::npos ? 0 : lineBegin + 1;
+		auto lineEnd = codes->find('\n', edit.offset + edit.text.size());
+		lineEnd = lineEnd == std::string::npos ? codes->size() : lineEnd;
+		incremental = utf8_valid({codes->data() + lineBegin, lineEnd - lineBegin});
+	}
+	if (!incremental) {
+		return parse<File_t>(*codes, options);
+	}
+
+	// parse the statements up to the first unchanged one, which has to
+	// start a line of its own in the new codes as well
+	ast_arena::scope arenaScope(info.arena.get());
+	ast_ptr<false, Block_t> regionBlock;
+	State state;
+	if (nextStmt) {
+		state.reparseLine = regionEndLine + lineDelta;
+	}
+	try {
+		error_list errors;
+		parse_options opt;
+		opt.memo_all = options.memoAll;
+		opt.tokens = options.reuseTokens;
+		opt.budget = options.budget;
+		opt.memo = &info.memoStats;
+		if (options.profileRules) {
+			opt.profile = &info.ruleProfile;
+		}
+		opt.start = regionBegin;
+		opt.start_line = regionLine;
+		regionBlock.set(::yue::start_with(*codes, reparse_region, errors, &state, opt));
+	} catch (const std::logic_error&) {
+	}
+	if (!regionBlock || state.exportCount > 0) {
+		return parse<File_t>(*codes, options);
+	}
+
+	// the statements after the new ones are shifted, so the positions
+	// of all the nodes are right when the reparse returns
+	auto& statements = file->block->statements;
+	const auto& objects = statements.objects();
+	shiftStatements(objects, last, objects.size(), byteDelta, lineDelta);
+	statements.replace(objects.begin() + first, objects.begin() + last, regionBlock->statements.objects());
+	file->m_end.m_it = codes->end();
+	file->m_end.m_line += lineDelta;
+	if (nextStmt) {
+		file->block->m_end.m_it += byteDelta;
+		file->block->m_end.m_line += lineDelta;
+	} else {
+		// the block and the file end in the edited lines
+		file->block->m_end = regionBlock->m_end;
+		auto lineBegin = codes->rfind('\n');
+		lineBegin = lineBegin == std::string::npos ? 0 : lineBegin + 1;
+		file->m_end.m_col = 1 + static_cast<int>(std::count_if(codes->begin() + lineBegin, codes->end(), [](char ch) {
+			return (static_cast<unsigned char>(ch) & 0xC0) != 0x80;
+		}));
+	}
+
+	std::vector<std::pair<int, std::string>> usedNameLines;
+	for (auto& item : info.usedNameLines) {
+		if (item.first < regionLine) {
+			usedNameLines.push_back(std::move(item));
+		} else if (item.first >= regionEndLine) {
+			usedNameLines.emplace_back(item.first + lineDelta, std::move(item.second));
+		}
+	}
+	std::move(state.usedNameLines.begin(), state.usedNameLines.end(), std::back_inserter(usedNameLines));
+	info.usedNames.clear();
+	for (const auto& item : usedNameLines) {
+		info.usedNames.insert(item.second);
+	}
+	info.usedNameLines = std::move(usedNameLines);
+	return std::move(info);
+}
+
+// hash of the AST node types and of their members, telling whether an
+// image was saved with the same AST layout
+static uint64_t astLayoutHash() {
+	static const uint64_t hash = []() {
+		uint64_t h = 14695981039346656037ull;
+		auto mix = [&](std::string_view bytes) {
+			for (char ch : bytes) {
+				h = (h ^ static_cast<uint8_t>(ch)) * 1099511628211ull;
+			}
+		};
+		for (int id = 1; id <= ast_type_count; ++id) {
+			ast_ptr<false, ast_node> node(new_ast(id));
+			mix(node->get_name());
+			for (const auto& member : node->members()) {
+				mix(member.type == ast_holder_type::List ? "L"sv : "P"sv);
+			}
+			mix(";"sv);
+		}
+		return h;
+	}();
+	return hash;
+}
+
+template <class T>
+static void writeValue(std::string& out, T value) {
+	out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void writeString(std::string& out, std::string_view str) {
+	writeValue(out, static_cast<uint32_t>(str.size()));
+	out.append(str);
+}
+
+template <class T>
+static bool readValue(std::string_view& in, T& value) {
+	if (in.size() < sizeof(value)) return false;
+	std::memcpy(&value, in.data(), sizeof(value));
+	in.remove_prefix(sizeof(value));
+	return true;
+}
+
+static bool readString(std::string_view& in, std::string_view& str) {
+	uint32_t size = 0;
+	if (!readValue(in, size) || in.size() < size) return false;
+	str = in.substr(0, size);
+	in.remove_prefix(size);
+	return true;
+}
+
+std::string YueParser::save(const ParseInfo& info) {
+	if (!info.node || !info.codes) return {};
+	// the used names are kept once in a string table,
+	// the used name lines refer to it
+	std::unordered_map<std::string_view, uint32_t> nameIndex;
+	std::vector<std::string_view> names;
+	auto intern = [&](std::string_view name) {
+		auto it = nameIndex.find(name);
+		if (it != nameIndex.end()) return it->second;
+		auto index = static_cast<uint32_t>(names.size());
+		nameIndex.emplace(name, index);
+		names.push_back(name);
+		return index;
+	};
+	for (const auto& name : info.usedNames) {
+		intern(name);
+	}
+	std::vector<std::pair<int32_t, uint32_t>> nameLines;
+	nameLines.reserve(info.usedNameLines.size());
+	for (const auto& item : info.usedNameLines) {
+		nameLines.emplace_back(item.first, intern(item.second));
+	}
+	std::string extra;
+	writeValue(extra, astLayoutHash());
+	uint32_t flags = (info.exportDefault ? 1 : 0) | (info.exportMacro ? 2 : 0) | (info.exportMetatable ? 4 : 0);
+	writeValue(extra, flags);
+	writeString(extra, info.moduleName);
+	writeValue(extra, static_cast<uint32_t>(names.size()));
+	for (auto name : names) {
+		writeString(extra, name);
+	}
+	writeValue(extra, static_cast<uint32_t>(nameLines.size()));
+	for (const auto& item : nameLines) {
+		writeValue(extra, item.first);
+		writeValue(extra, item.second);
+	}
+	return ast_image::save(info.node.get(), *info.codes, extra);
+}
+
+ParseInfo YueParser::load(std::string_view image) {
+	ParseInfo res;
+	auto fail = [&]() {
+		res.node.set(nullptr);
+		res.error = {"invalid AST image"s, 1, 1};
+		return std::move(res);
+	};
+	ast_image img;
+	if (!img.open(image)) return fail();
+	auto extra = img.extra();
+	uint64_t hash = 0;
+	uint32_t flags = 0;
+	std::string_view moduleName;
+	uint32_t nameCount = 0;
+	if (!readValue(extra, hash) || hash != astLayoutHash() || !readValue(extra, flags) || !readString(extra, moduleName) || !readValue(extra, nameCount)) {
+		return fail();
+	}
+	std::vector<std::string_view> names;
+	for (uint32_t i = 0; i < nameCount; ++i) {
+		std::string_view name;
+		if (!readString(extra, name)) return fail();
+		names.push_back(name);
+		res.usedNames.insert(std::string(name));
+	}
+	uint32_t lineCount = 0;
+	if (!readValue(extra, lineCount)) return fail();
+	for (uint32_t i = 0; i < lineCount; ++i) {
+		int32_t line = 0;
+		uint32_t index = 0;
+		if (!readValue(extra, line) || !readValue(extra, index) || index >= names.size()) {
+			return fail();
+		}
+		res.usedNameLines.emplace_back(line, std::string(names[index]));
+	}
+	res.exportDefault = (flags & 1) != 0;
+	res.exportMacro = (flags & 2) != 0;
+	res.exportMetatable = (flags & 4) != 0;
+	res.moduleName = std::string(moduleName);
+	res.codes = std::make_unique<input>(img.codes());
+	res.arena = ast_arena::make();
+	ast_arena::scope arenaScope(res.arena.get());
+	res.node.set(img.load(&new_ast, *res.codes));
+	if (!res.node) return fail();
+	return res;
+}
+
+MappedFile::MappedFile(const std::string& path) {
+#ifndef _WIN32
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) return;
+	struct stat info;
+	if (::fstat(fd, &info) == 0) {
+		_open = true;
+		_size = static_cast<size_t>(info.st_size);
+		if (_size > 0) {
+			void* data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data != MAP_FAILED) {
+				_data = static_cast<const char*>(data);
+				_mapped = true;
+			} else {
+				_open = false;
+				_size = 0;
+			}
+		}
+	}
+	::close(fd);
+#else
+	std::ifstream input(path, std::ios::in | std::ios::binary);
+	if (!input) return;
+	std::ostringstream buf;
+	buf << input.rdbuf();
+	_buffer = buf.str();
+	_open = true;
+	_data = _buffer.data();
+	_size = _buffer.size();
+#endif // _WIN32
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+	if (_mapped) {
+		::munmap(const_cast<char*>(_data), _size);
+	}
+#endif // _WIN32
+}
+
 bool YueParser::match(std::string_view astName, std::string_view codes) {
 	auto it = _rules.find(astName);
 	if (it != _rules.end()) {
@@ -1102,19 +1707,32 @@ bool YueParser::match(std::string_view astName, std::string_view codes) {
 }
 
 std::string YueParser::toString(ast_node* node) {
-	return _converter.to_bytes(std::wstring(node->m_begin.m_it, node->m_end.m_it));
+	return std::string(node->m_begin.m_it, node->m_end.m_it);
 }
 
 std::string YueParser::toString(input::iterator begin, input::iterator end) {
-	return _converter.to_bytes(std::wstring(begin, end));
+	return std::string(begin, end);
 }
 
 bool YueParser::hasAST(std::string_view name) const {
 	return _rules.find(name) != _rules.end();
 }
 
+bool YueParser::setMemo(std::string_view astName, bool on) {
+	auto it = _rules.find(astName);
+	if (it == _rules.end() || (on && reaches_user(*it->second))) {
+		return false;
+	}
+	it->second->set_memo(on);
+	return true;
+}
+
+size_t YueParser::optimizedExprCount() const {
+	return _optimizedExprCount;
+}
+
 YueParser& YueParser::shared() {
-	thread_local static YueParser parser;
+	static YueParser parser;
 	return parser;
 }
 
@@ -1160,12 +1778,11 @@ std::string ParseInfo::errorMessage(std::string_view msg, int errLine, int errCo
 	int col = std::max(0, oldCol - 1);
 	auto it = begin;
 	for (int i = 0; i < oldCol && it != end; ++i) {
-		if (*it > ASCII) {
+		if (utf8_next(it, end) > ASCII) {
 			++col;
 		}
-		++it;
 	}
-	auto line = Converter{}.to_bytes(std::wstring(begin, end));
+	auto line = std::string(begin, end);
 	while (col < static_cast<int>(line.size())
 		   && (line[col] == ' ' || line[col] == '\t')) {
 		col++;
@@ -9,6 +9,7 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 #pragma once
 
 #include <algorithm>
+#include <limits>
 #include <list>
 #include <memory>
 #include <optional>
@@ -18,6 +19,7 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 #include <string_view>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include "yuescript/ast.hpp"
 #include "yuescript/yue_ast.h"
@@ -34,6 +36,7 @@ struct ParseInfo {
 		int line;
 		int col;
 	};
+	std::shared_ptr<ast_arena> arena;
 	ast_ptr<false, ast_node> node;
 	std::optional<Error> error;
 	std::unique_ptr<input> codes;
@@ -42,23 +45,52 @@ struct ParseInfo {
 	bool exportMetatable = false;
 	std::string moduleName;
 	std::unordered_set<std::string> usedNames;
+	std::vector<std::pair<int, std::string>> usedNameLines;
+	memo_stats memoStats;
+	parse_profile ruleProfile;
 	std::string errorMessage(std::string_view msg, int errLine, int errCol, int lineOffset = 0) const;
 };
 
+struct ParseOptions {
+	bool memoAll = false;
+	bool reuseTokens = false;
+	bool profileRules = false;
+	int threads = 0;
+	size_t budget = 0;
+};
+
+struct TextEdit {
+	size_t offset = 0;
+	size_t length = 0;
+	std::string_view text;
+};
+
+/** read only contents of a file, mapped in memory where the platform
+	allows it, or read into a buffer otherwise.
+ */
+class MappedFile {
+public:
+	explicit MappedFile(const std::string& path);
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool isOpen() const { return _open; }
+	std::string_view data() const { return {_data, _size}; }
+
+private:
+	bool _open = false;
+	bool _mapped = false;
+	const char* _data = nullptr;
+	size_t _size = 0;
+	std::string _buffer;
+};
+
 template <typename T>
 struct identity {
 	typedef T type;
 };
 
-#ifdef NDEBUG
-#define NONE_AST_RULE(type) \
-	rule type;
-
-#define AST_RULE(type) \
-	rule type; \
-	ast<type##_t> type##_impl{collect(ast_name<type##_t>(), type)}; \
-	inline rule& getRule(identity<type##_t>) { return type; }
-#else // NDEBUG
 #define NONE_AST_RULE(type) \
 	rule type{#type, rule::initTag{}};
 
@@ -66,7 +98,6 @@ struct identity {
 	rule type{#type, rule::initTag{}}; \
 	ast<type##_t> type##_impl{collect(ast_name<type##_t>(), type)}; \
 	inline rule& getRule(identity<type##_t>) { return type; }
-#endif // NDEBUG
 
 extern std::unordered_set<std::string> LuaKeywords;
 extern std::unordered_set<std::string> Keywords;
@@ -74,11 +105,21 @@ extern std::unordered_set<std::string> Keywords;
 class YueParser {
 public:
 	template <class AST>
-	ParseInfo parse(std::string_view codes) {
-		return parse(codes, getRule<AST>());
+	ParseInfo parse(std::string_view codes, const ParseOptions& options = {}) {
+		return parse(codes, getRule<AST>(), options);
 	}
 
-	ParseInfo parse(std::string_view astName, std::string_view codes);
+	ParseInfo parse(std::string_view astName, std::string_view codes, const ParseOptions& options = {});
+
+	ParseInfo reparse(ParseInfo&& info, const TextEdit& edit, const ParseOptions& options = {});
+
+	// writes a parse result in the binary AST image format, to be loaded
+	// again without parsing, returns empty for a failed parse
+	static std::string save(const ParseInfo& info);
+
+	// loads a parse result from an image made by save, the image can be
+	// a mapped file and is not kept
+	static ParseInfo load(std::string_view image);
 
 	template <class AST>
 	bool match(std::string_view codes) {
@@ -98,11 +139,19 @@ public:
 
 	bool hasAST(std::string_view name) const;
 
+	// memoizes the results of the rule of an AST name in the next parses,
+	// returns false when there is no such rule or its results depend on
+	// the parse state, which a memoized result would skip
+	bool setMemo(std::string_view astName, bool on = true);
+
+	size_t optimizedExprCount() const;
+
 	static YueParser& shared();
 
 protected:
 	YueParser();
-	ParseInfo parse(std::string_view codes, rule& r);
+	ParseInfo parse(std::string_view codes, rule& r, const ParseOptions& options = {});
+	bool parseInParallel(ParseInfo& res, const ParseOptions& options);
 	bool startWith(std::string_view codes, rule& r);
 
 	struct State {
@@ -124,6 +173,8 @@ protected:
 		std::stack<bool> noTableBlockStack;
 		std::stack<bool> noForStack;
 		std::unordered_set<std::string> usedNames;
+		std::vector<std::pair<int, std::string>> usedNameLines;
+		int reparseLine = std::numeric_limits<int>::max();
 	};
 
 	template <class T>
@@ -132,8 +183,8 @@ protected:
 	}
 
 private:
-	Converter _converter;
 	std::unordered_map<std::string_view, rule*> _rules;
+	size_t _optimizedExprCount = 0;
 
 	template <class T>
 	inline rule& getRule(identity<T>) {
@@ -437,6 +488,15 @@ private:
 	AST_RULE(Block);
 	AST_RULE(BlockEnd);
 	AST_RULE(File);
+
+	// top-level statements parsed apart from the others,
+	// ending at the first line at or after State::reparseLine
+	NONE_AST_RULE(reparse_stop);
+	NONE_AST_RULE(reparse_end);
+	NONE_AST_RULE(reparse_block);
+	ast<Block_t> reparse_block_impl{reparse_block};
+	NONE_AST_RULE(reparse_region);
+	NONE_AST_RULE(reparse_head);
 };
 
 namespace Utils {
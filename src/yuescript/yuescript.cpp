@@ -93,6 +93,12 @@ static void get_config(lua_State* L, yue::YueConfig& config) {
 		config.useSpaceOverTab = lua_toboolean(L, -1) != 0;
 	}
 	lua_pop(L, 1);
+	lua_pushliteral(L, "parse_budget");
+	lua_gettable(L, -2);
+	if (lua_isnumber(L, -1) != 0) {
+		config.parseBudget = static_cast<size_t>(lua_tonumber(L, -1));
+	}
+	lua_pop(L, 1);
 	lua_pushliteral(L, "options");
 	lua_gettable(L, -2);
 	if (lua_istable(L, -1) != 0) {